@@ -6,7 +6,9 @@
 #ifndef BITS_H
 #define BITS_H 1
 
-typedef unsigned int Bits;
+#include <stdint.h>
+
+typedef uint64_t Bits;
 
 int bitIsSet(Bits, int);
 Bits setBit(Bits, int);
@@ -0,0 +1,434 @@
+// bufpool.c ... page buffer pool
+// part of Multi-attribute Linear-hashed Files
+// Caches pages from open relation files in a fixed set of frames
+
+// pread(), pwrite(), fileno() and posix_memalign() are not in plain C99
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "defs.h"
+#include "bufpool.h"
+#include "uring.h"
+
+// The pool is a single arena of up to MAXBUFFERS frames of MAXPAGESIZE bytes
+// - each frame holds one page of one file, identified by (file,pid)
+// - pages may be smaller than a frame; files can use different sizes
+// - a frame is pinned while some caller holds a pointer into it
+// - only unpinned frames can be chosen for replacement
+// - replacement uses the clock algorithm (one reference bit per frame)
+// - dirty frames are written back when replaced, or on bufFlush/bufDrop
+// - a hash table on (file,pid) finds resident pages without scanning
+// - pages are read and written with pread()/pwrite() on the file's
+//   descriptor, bypassing stdio's buffer and file position
+// - frames are aligned on MAXPAGESIZE, so files opened for direct
+//   I/O (see directFile() in page.c) can use them as they are
+// - bufPrefetch() starts reading a run of consecutive pages into
+//   frames in the background (with io_uring), as one vectored read;
+//   the frames are "pending" until the read finishes, and bufGet()
+//   waits for one if need be
+// - without io_uring, bufPrefetch() just asks the kernel to read
+//   the pages into its page cache
+// - the pool starts with NBUFFERS frames and can grow to MAXBUFFERS
+//   when no frame can be replaced
+//
+// For files that are write-ahead logged (see wal.c), a changed page
+//  may not reach the file until its image is in the log:
+// - frames changed since they were last logged are "unlogged"
+// - unlogged frames are never replaced or written back
+// - bufLogPages() hands each unlogged frame to the logger
+//
+// The pool can be used by several threads at once: one mutex
+//  guards the frame table, and is held only inside this file
+// The contents of a pinned frame are the caller's to protect
+// bufGet() doesn't hold the mutex while it reads a page or writes
+//  back a victim; the frame is "busy" until the I/O is done, and
+//  other threads that want it (or want to flush it) wait for that,
+//  so page misses in different threads can overlap
+
+typedef struct BufFrame {
+	FILE   *file;  // file the page comes from (NULL if frame unused)
+	PageID  pid;   // page number within that file
+	Count   size;  // page size of that file
+	Count   pins;  // number of callers currently using the frame
+	Bool    dirty; // modified since it was read?
+	Bool    ref;   // clock reference bit
+	Bool    unlogged; // changed since last logged?
+	Bool    pending;  // being read in the background?
+	Bool    busy;     // being read or written by bufGet()?
+	struct BufFrame *next; // next frame in same hash chain
+} BufFrame;
+
+#define NHASH (2*NBUFFERS)
+#define MAXLOGGED 8
+#define MAXREADS  64
+
+// frames being filled by one background read
+typedef struct ReadRun {
+	Count  n;               // #frames (0 if unused)
+	BufFrame *frames[MAXRUN];
+	struct iovec iov[MAXRUN];
+} ReadRun;
+
+static BufFrame *frames = NULL;  // frame descriptors
+static char     *arena = NULL;   // page contents, MAXBUFFERS*MAXPAGESIZE bytes
+static BufFrame *table[NHASH];   // hash chains on (file,pid)
+static Count     nframes = NBUFFERS; // frames currently in use
+static Count     hand = 0;       // clock hand
+static FILE     *logged[MAXLOGGED]; // files that are write-ahead logged
+static Count     nunlogged = 0;  // #unlogged frames
+static Bool      async = FALSE;  // can do background reads?
+static ReadRun   runs[MAXREADS]; // background reads in progress
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  iodone = PTHREAD_COND_INITIALIZER; // a frame is no longer busy
+
+static void initPool()
+{
+	// arena is only touched as frames are used
+	frames = calloc(MAXBUFFERS, sizeof(BufFrame));
+	void *a;
+	if (posix_memalign(&a, MAXPAGESIZE, (size_t)MAXBUFFERS*MAXPAGESIZE) != 0)
+		a = NULL;
+	arena = a;
+	if (frames == NULL || arena == NULL)
+		fatal("Can't allocate buffer pool");
+	async = (uringInit(MAXREADS) == OK);
+}
+
+static Count hashKey(FILE *f, PageID pid)
+{
+	unsigned long k = (unsigned long)f ^ ((unsigned long)pid * 2654435761u);
+	return (Count)(k % NHASH);
+}
+
+static char *frameData(BufFrame *b) { return arena + (b-frames)*MAXPAGESIZE; }
+
+static BufFrame *frameOf(void *p)
+{
+	Count i = ((char *)p - arena)/MAXPAGESIZE;
+	assert(frameData(&frames[i]) == p);
+	return &frames[i];
+}
+
+static BufFrame *lookup(FILE *f, PageID pid)
+{
+	BufFrame *b;
+	for (b = table[hashKey(f,pid)]; b != NULL; b = b->next)
+		if (b->file == f && b->pid == pid) return b;
+	return NULL;
+}
+
+static void unhash(BufFrame *b)
+{
+	BufFrame **bp = &table[hashKey(b->file,b->pid)];
+	while (*bp != b) bp = &(*bp)->next;
+	*bp = b->next;
+	b->next = NULL;
+}
+
+static Bool isLogged(FILE *f)
+{
+	Count i;
+	for (i = 0; i < MAXLOGGED; i++)
+		if (logged[i] == f) return TRUE;
+	return FALSE;
+}
+
+// the caller clears b->dirty (with poollock held)
+
+static void writeFrame(BufFrame *b)
+{
+	assert(!b->unlogged);
+	ssize_t n = pwrite(fileno(b->file), frameData(b), b->size,
+	                   (off_t)b->pid*b->size);
+	if (n != b->size) fatal("Can't write page");
+}
+
+static void readFrame(BufFrame *b)
+{
+	ssize_t n = pread(fileno(b->file), frameData(b), b->size,
+	                  (off_t)b->pid*b->size);
+	if (n != b->size) fatal("Can't read page");
+}
+
+// background read tag has finished
+// if it failed, read the pages again the ordinary way
+
+static void readDone(unsigned long tag, int res)
+{
+	ReadRun *run = &runs[tag];
+	Count i, size = run->frames[0]->size;
+	for (i = 0; i < run->n; i++) {
+		BufFrame *b = run->frames[i];
+		b->pending = FALSE;
+		if (res != run->n*size) readFrame(b);
+	}
+	run->n = 0;
+}
+
+// deal with finished background reads
+// if b is given, wait until its read has finished
+
+static void reapReads(BufFrame *b)
+{
+	unsigned long tag;
+	int res;
+	while (uringReap(b != NULL && b->pending, &tag, &res))
+		readDone(tag, res);
+}
+
+// run the clock until we find an unpinned, logged frame
+// whose reference bit has already been cleared
+// if there isn't one, add a frame to the pool
+
+static BufFrame *chooseVictim()
+{
+	Count tries;
+	for (tries = 0; tries < 2*nframes; tries++) {
+		BufFrame *b = &frames[hand];
+		hand = (hand+1) % nframes;
+		if (b->pins > 0 || b->unlogged || b->pending || b->busy) continue;
+		if (b->ref) { b->ref = FALSE; continue; }
+		return b;
+	}
+	if (nframes == MAXBUFFERS)
+		fatal("Buffer pool: all frames are pinned or unlogged");
+	return &frames[nframes++];
+}
+
+// give page pid of file f frame b, replacing the page in it
+
+static void assignFrame(BufFrame *b, FILE *f, PageID pid, Count size)
+{
+	if (b->file != NULL) unhash(b);
+	b->file = f; b->pid = pid; b->size = size; b->dirty = FALSE;
+	Count h = hashKey(f,pid);
+	b->next = table[h]; table[h] = b;
+}
+
+// give page pid of file f a frame, replacing some other page
+// a dirty victim is written back with poollock held (see bufGet())
+
+static BufFrame *claimFrame(FILE *f, PageID pid, Count size)
+{
+	BufFrame *b = chooseVictim();
+	if (b->file != NULL && b->dirty) {
+		writeFrame(b);
+		b->dirty = FALSE;
+	}
+	assignFrame(b, f, pid, size);
+	return b;
+}
+
+// do I/O on busy frame b without holding poollock
+
+static void frameIO(BufFrame *b, void (*io)(BufFrame *))
+{
+	b->busy = TRUE;
+	pthread_mutex_unlock(&poollock);
+	io(b);
+	pthread_mutex_lock(&poollock);
+	b->busy = FALSE;
+	pthread_cond_broadcast(&iodone);
+}
+
+// return a pinned frame holding page pid of file f
+// size is the page size used by f
+// if load is FALSE and the page is not resident, the
+//  frame contents are undefined (caller will overwrite)
+
+void *bufGet(FILE *f, PageID pid, Count size, Bool load)
+{
+	pthread_mutex_lock(&poollock);
+	if (frames == NULL) initPool();
+	BufFrame *b;
+	for (;;) {
+		b = lookup(f, pid);
+		if (async) reapReads(b);
+		if (b != NULL && b->busy) {
+			// another thread is reading it, or writing it back
+			pthread_cond_wait(&iodone, &poollock);
+			continue;
+		}
+		if (b != NULL) break;
+		BufFrame *v = chooseVictim();
+		if (v->file != NULL && v->dirty) {
+			// the page may have arrived by the time this is done,
+			//  so look again
+			frameIO(v, writeFrame);
+			v->dirty = FALSE;
+			continue;
+		}
+		assignFrame(v, f, pid, size);
+		if (load) frameIO(v, readFrame);
+		b = v;
+		break;
+	}
+	b->pins++;
+	b->ref = TRUE;
+	pthread_mutex_unlock(&poollock);
+	return frameData(b);
+}
+
+// read pages first..first+n-1 of file f in the background
+
+static void startRun(FILE *f, PageID first, Count n, Count size)
+{
+	if (!async) {
+		posix_fadvise(fileno(f), (off_t)first*size, (off_t)n*size,
+		              POSIX_FADV_WILLNEED);
+		return;
+	}
+	Count r, i;
+	for (r = 0; r < MAXREADS; r++)
+		if (runs[r].n == 0) break;
+	if (r == MAXREADS || uringFull()) return;
+	ReadRun *run = &runs[r];
+	for (i = 0; i < n; i++) {
+		BufFrame *b = claimFrame(f, first+i, size);
+		b->pending = TRUE;
+		b->ref = TRUE;
+		run->frames[i] = b;
+		run->iov[i].iov_base = frameData(b);
+		run->iov[i].iov_len = size;
+	}
+	run->n = n;
+	uringReadv(fileno(f), run->iov, n, (off_t)first*size, r);
+	uringSubmit();
+}
+
+// start reading pages pid..pid+n-1 of file f, where not already here
+// each run of absent pages is read together, up to MAXRUN at a time
+// this is only a hint: if no read can be started, nothing happens
+
+void bufPrefetch(FILE *f, PageID pid, Count n, Count size)
+{
+	pthread_mutex_lock(&poollock);
+	if (frames == NULL) initPool();
+	PageID p, first = pid;
+	for (p = pid; p <= pid+n; p++) {
+		Bool here = (p == pid+n || lookup(f, p) != NULL);
+		if (p > first && (here || p - first == MAXRUN)) {
+			startRun(f, first, p - first, size);
+			first = p;
+		}
+		if (here) first = p+1;
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+// unpin a frame; dirty says whether the caller changed it
+
+void bufRelease(void *p, Bool dirty)
+{
+	BufFrame *b = frameOf(p);
+	pthread_mutex_lock(&poollock);
+	assert(b->pins > 0);
+	b->pins--;
+	if (dirty) {
+		b->dirty = TRUE;
+		if (!b->unlogged && isLogged(b->file)) {
+			b->unlogged = TRUE;
+			nunlogged++;
+		}
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+// is p the start of a buffer pool frame?
+
+Bool bufIsFrame(void *p)
+{
+	if (arena == NULL) return FALSE;
+	char *c = p;
+	return (c >= arena && c < arena + (size_t)MAXBUFFERS*MAXPAGESIZE);
+}
+
+PageID bufPageID(void *p) { return frameOf(p)->pid; }
+FILE *bufFile(void *p) { return frameOf(p)->file; }
+
+// write back all dirty pages belonging to file f
+
+static void flushFrames(FILE *f)
+{
+	Count i;
+	for (i = 0; i < nframes; i++) {
+		BufFrame *b = &frames[i];
+		while (b->busy) pthread_cond_wait(&iodone, &poollock);
+		if (b->file == f && b->dirty) {
+			writeFrame(b);
+			b->dirty = FALSE;
+		}
+	}
+}
+
+void bufFlush(FILE *f)
+{
+	if (frames == NULL) return;
+	pthread_mutex_lock(&poollock);
+	flushFrames(f);
+	pthread_mutex_unlock(&poollock);
+}
+
+// write back and forget all pages belonging to file f
+// called before f is closed, since its FILE* may be reused
+
+void bufDrop(FILE *f)
+{
+	if (frames == NULL) return;
+	pthread_mutex_lock(&poollock);
+	flushFrames(f);
+	Count i;
+	for (i = 0; i < nframes; i++) {
+		BufFrame *b = &frames[i];
+		if (b->file != f) continue;
+		reapReads(b);
+		assert(b->pins == 0);
+		unhash(b);
+		b->file = NULL; b->ref = FALSE;
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+// say whether pages of file f must be logged before being written
+
+void bufSetLogging(FILE *f, Bool on)
+{
+	Count i;
+	pthread_mutex_lock(&poollock);
+	for (i = 0; i < MAXLOGGED; i++) {
+		if (on && logged[i] == NULL) { logged[i] = f; break; }
+		if (!on && logged[i] == f) { logged[i] = NULL; break; }
+	}
+	assert(!on || i < MAXLOGGED);
+	pthread_mutex_unlock(&poollock);
+}
+
+// number of frames waiting to be logged
+
+Count bufUnlogged()
+{
+	pthread_mutex_lock(&poollock);
+	Count n = nunlogged;
+	pthread_mutex_unlock(&poollock);
+	return n;
+}
+
+// pass each unlogged frame of f to log(arg,pid,page,size)
+// the frames can be written back once this returns
+
+void bufLogPages(FILE *f, void (*log)(void *, PageID, void *, Count), void *arg)
+{
+	if (frames == NULL) return;
+	Count i;
+	pthread_mutex_lock(&poollock);
+	for (i = 0; i < nframes; i++) {
+		BufFrame *b = &frames[i];
+		if (b->file != f || !b->unlogged) continue;
+		log(arg, b->pid, frameData(b), b->size);
+		b->unlogged = FALSE;
+		nunlogged--;
+	}
+	pthread_mutex_unlock(&poollock);
+}
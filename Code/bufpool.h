@@ -0,0 +1,27 @@
+// bufpool.h ... interface to the page buffer pool
+// part of Multi-attribute Linear-hashed Files
+// See bufpool.c for details of frames and replacement
+// Pages handed out by the pool are pinned until released
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H 1
+
+#include "defs.h"
+
+#define NBUFFERS 256
+#define MAXBUFFERS 4096
+#define MAXRUN 16
+
+void *bufGet(FILE *, PageID, Count, Bool);
+void bufRelease(void *, Bool);
+void bufPrefetch(FILE *, PageID, Count, Count);
+Bool bufIsFrame(void *);
+PageID bufPageID(void *);
+FILE *bufFile(void *);
+void bufFlush(FILE *);
+void bufDrop(FILE *);
+void bufSetLogging(FILE *, Bool);
+Count bufUnlogged();
+void bufLogPages(FILE *, void (*)(void *, PageID, void *, Count), void *);
+
+#endif
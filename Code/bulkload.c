@@ -0,0 +1,323 @@
+// bulkload.c ... build a Relation from a large set of tuples
+// part of Multi-attribute linear-hashed files
+// Reads tuples from stdin and loads them into an empty Reln
+// Usage:  ./bulkload  [-v]  [-n #tuples]  RelName
+
+#include "defs.h"
+#include "reln.h"
+#include "tuple.h"
+
+#define USAGE "./bulkload  [-v]  [-n #tuples]  RelName"
+
+#define BULKMEM (64 << 20)  // most bytes of tuples held in memory
+#define NPARTS  64          // #partitions if tuples don't fit
+
+// Rather than inserting tuples one at a time (and splitting
+//  buckets as the file grows), the loader
+// - reads and hashes every tuple once
+// - works out the final shape of the file from the tuples, using
+//   the relation's split policy (see bulkInsert() in reln.c)
+// - groups tuples by bucket, and writes every page once, in
+//   file order
+// If the tuples don't fit in memory, they are spread over NPARTS
+//  temporary files, each holding a range of buckets, which are
+//  then loaded one at a time
+// With -n, the #tuples is known in advance, so tuples can go to
+//  their partitions as they are read; otherwise they are first
+//  spilled to a single temporary file
+// -n only works if the split policy depends just on the #tuples
+//  (SPLIT_EVERY); relations that split when an overflow page is
+//  added (SPLIT_OVFLOW) can't be bulk loaded
+// The load is not logged; if it fails, re-create the relation
+
+// a set of tuples in memory, with their hashes
+typedef struct Batch {
+	char   *tuples; // tuples, back-to-back at even offsets
+	Count   used;   // #bytes in tuples
+	Count   size;   // #bytes allocated for tuples
+	Bits   *hashes; // hash of each tuple
+	Offset *offs;   // offset of each tuple in tuples
+	Count   n;      // #tuples
+	Count   max;    // #entries allocated in hashes and offs
+} Batch;
+
+static void batchInit(Batch *b)
+{
+	b->size = 1 << 20; b->max = 1 << 14;
+	b->tuples = malloc(b->size);
+	b->hashes = malloc(b->max*sizeof(Bits));
+	b->offs = malloc(b->max*sizeof(Offset));
+	if (b->tuples == NULL || b->hashes == NULL || b->offs == NULL)
+		fatal("Out of memory");
+	b->used = b->n = 0;
+}
+
+static void batchFree(Batch *b)
+{
+	free(b->tuples); free(b->hashes); free(b->offs);
+}
+
+static void batchAdd(Batch *b, Tuple t, Bits h)
+{
+	Count len = tupLength(t);
+	len += len & 1;
+	while (b->used + len > b->size) {
+		b->size *= 2;
+		b->tuples = realloc(b->tuples, b->size);
+		if (b->tuples == NULL) fatal("Out of memory");
+	}
+	if (b->n == b->max) {
+		b->max *= 2;
+		b->hashes = realloc(b->hashes, b->max*sizeof(Bits));
+		b->offs = realloc(b->offs, b->max*sizeof(Offset));
+		if (b->hashes == NULL || b->offs == NULL) fatal("Out of memory");
+	}
+	memcpy(b->tuples + b->used, t, tupLength(t));
+	b->hashes[b->n] = h;
+	b->offs[b->n] = b->used;
+	b->used += len; b->n++;
+}
+
+// hash b's tuples from from on, which were added without hashes
+// this is done every HASHBATCH tuples, while they are in cache,
+//  so that they can be hashed together (see tupleHashBatch())
+
+#define HASHBATCH 1024
+
+static void hashPending(Reln r, Batch *b, Count from)
+{
+	Count i, n = b->n - from;
+	Tuple *ts = malloc((n+1)*sizeof(Tuple));
+	if (ts == NULL) fatal("Out of memory");
+	for (i = 0; i < n; i++) ts[i] = b->tuples + b->offs[from+i];
+	tupleHashBatch(r, ts, n, b->hashes + from);
+	free(ts);
+}
+
+// temporary files hold records of (hash, length, tuple bytes)
+
+static void writeRecord(FILE *f, Tuple t, Bits h)
+{
+	Count len = tupLength(t);
+	if (fwrite(&h, sizeof(Bits), 1, f) != 1
+	    || fwrite(&len, sizeof(Count), 1, f) != 1
+	    || fwrite(t, 1, len, f) != len)
+		fatal("Can't write temporary file");
+}
+
+// read the next record from f into buf (MAXRECORD bytes, aligned
+//  for a tuple) and h; returns FALSE at end of file
+
+#define MAXRECORD 0x10000
+
+static Bool readRecord(FILE *f, char *buf, Bits *h)
+{
+	Count len;
+	if (fread(h, sizeof(Bits), 1, f) != 1) return FALSE;
+	if (fread(&len, sizeof(Count), 1, f) != 1 || len > MAXRECORD
+	    || fread(buf, 1, len, f) != len)
+		fatal("Can't read temporary file");
+	return TRUE;
+}
+
+// add all records in f to b; returns #records read
+
+static Count readRecords(FILE *f, Batch *b)
+{
+	unsigned short buf[MAXRECORD/2];
+	Bits h; Count n = 0;
+	rewind(f);
+	while (readRecord(f, (char *)buf, &h)) {
+		batchAdd(b, (char *)buf, h);
+		n++;
+	}
+	return n;
+}
+
+// which partition holds bucket p?
+
+static Count partOf(Reln r, PageID p)
+{
+	return ((unsigned long)p * NPARTS) / npages(r);
+}
+
+// write each tuple in b to the partition holding its bucket
+
+static void spread(Reln r, Batch *b, FILE **parts)
+{
+	Count i;
+	for (i = 0; i < b->n; i++) {
+		Tuple t = b->tuples + b->offs[i];
+		writeRecord(parts[partOf(r, bucketOf(r, b->hashes[i]))], t, b->hashes[i]);
+	}
+	b->used = b->n = 0;
+}
+
+// write buckets lo..hi-1, which hold all of the tuples in b
+
+static void writeBuckets(Reln r, Batch *b, PageID lo, PageID hi)
+{
+	Count nb = hi - lo, i;
+	PageID p;
+	Count *start = calloc(nb+1, sizeof(Count));
+	Tuple *ts = malloc((b->n+1)*sizeof(Tuple));
+	Bits *hs = malloc((b->n+1)*sizeof(Bits));
+	if (start == NULL || ts == NULL || hs == NULL) fatal("Out of memory");
+	// counting sort on bucket
+	for (i = 0; i < b->n; i++) {
+		p = bucketOf(r, b->hashes[i]);
+		assert(p >= lo && p < hi);
+		start[p-lo+1]++;
+	}
+	for (p = 0; p < nb; p++) start[p+1] += start[p];
+	for (i = 0; i < b->n; i++) {
+		Count j = start[bucketOf(r, b->hashes[i]) - lo]++;
+		ts[j] = b->tuples + b->offs[i];
+		hs[j] = b->hashes[i];
+	}
+	// start[k] is now the end of bucket lo+k
+	Count from = 0;
+	for (p = 0; p < nb; p++) {
+		if (addBucketToRelation(r, lo+p, ts+from, hs+from, start[p]-from) != OK)
+			fatal("Tuple too large for page");
+		from = start[p];
+	}
+	free(start); free(ts); free(hs);
+}
+
+// Main ... process args, read/partition/load tuples
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	Tuple t;  // tuple buffer
+	char err[MAXERRMSG];  // buffer for error messages
+	int verbose;  // show loading progress
+	char *rname;  // name of table/file
+	long hint;  // expected #tuples, or -1 if not known
+	Count i;
+
+	// process command-line args
+
+	int a = 1;
+	verbose = 0; hint = -1;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-n") == 0 && a+1 < argc)
+			hint = atol(argv[++a]);
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (a >= argc || hint < -1) fatal(USAGE);
+	rname = argv[a];
+
+	// set up relation for loading
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s", rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r+")) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+	if (ntuples(r) != 0) {
+		sprintf(err, "Relation %s is not empty", rname);
+		fatal(err);
+	}
+	if (beginBulkLoad(r) != OK || splitPolicy(r) == SPLIT_OVFLOW) {
+		sprintf(err, "Can't bulk load relation %s", rname);
+		fatal(err);
+	}
+	if (hint >= 0 && splitPolicy(r) != SPLIT_EVERY)
+		fatal("-n needs a relation that splits every K inserts");
+	Total k;
+	for (k = 0; (long)k < hint; k++) bulkInsert(r, 0);
+
+	// read and hash all tuples, spilling any that don't fit
+
+	Batch b;
+	batchInit(&b);
+	FILE *spill = NULL, *parts[NPARTS] = { NULL };
+	Total ntups = 0;
+	Count hashed = 0;  // b's tuples before this have their hashes
+	while ((t = readTuple(r,stdin)) != NULL) {
+		if (hint < 0) bulkInsert(r, tupLength(t));
+		batchAdd(&b, t, 0);
+		free(t);
+		ntups++;
+		if (b.n - hashed == HASHBATCH) {
+			hashPending(r, &b, hashed);
+			hashed = b.n;
+		}
+		if (b.used < BULKMEM) continue;
+		hashPending(r, &b, hashed);
+		hashed = 0;
+		if (parts[0] == NULL) {
+			for (i = 0; i < NPARTS; i++)
+				if ((parts[i] = tmpfile()) == NULL)
+					fatal("Can't create temporary file");
+		}
+		if (hint >= 0)
+			spread(r, &b, parts);
+		else {
+			if (spill == NULL && (spill = tmpfile()) == NULL)
+				fatal("Can't create temporary file");
+			for (i = 0; i < b.n; i++)
+				writeRecord(spill, b.tuples + b.offs[i], b.hashes[i]);
+			b.used = b.n = 0;
+		}
+	}
+	hashPending(r, &b, hashed);
+	if (hint >= 0 && ntups != hint) {
+		sprintf(err, "Read %lu tuples, but expected %ld", ntups, hint);
+		fatal(err);
+	}
+	if (verbose)
+		printf("%lu tuples, %lu buckets, d=%d, sp=%lu\n",
+		       ntups, npages(r), depth(r), splitp(r));
+
+	// load buckets, from memory or one partition at a time
+
+	if (parts[0] == NULL)
+		writeBuckets(r, &b, 0, npages(r));
+	else {
+		if (spill != NULL) {
+			// spilled tuples go to partitions a chunk at a time
+			Batch sb;
+			unsigned short buf[MAXRECORD/2];
+			Bits h;
+			batchInit(&sb);
+			rewind(spill);
+			while (readRecord(spill, (char *)buf, &h)) {
+				batchAdd(&sb, (char *)buf, h);
+				if (sb.used >= BULKMEM) spread(r, &sb, parts);
+			}
+			spread(r, &sb, parts);
+			batchFree(&sb);
+			fclose(spill);
+		}
+		spread(r, &b, parts);
+		PageID np = npages(r);
+		for (i = 0; i < NPARTS; i++) {
+			// partition i holds buckets lo..hi-1
+			PageID lo = ((unsigned long)i*np + NPARTS-1) / NPARTS;
+			PageID hi = ((unsigned long)(i+1)*np + NPARTS-1) / NPARTS;
+			Count n = readRecords(parts[i], &b);
+			if (verbose) printf("partition %d: buckets %lu..%lu, %d tuples\n",
+			                    i, lo, hi-1, n);
+			writeBuckets(r, &b, lo, hi);
+			b.used = b.n = 0;
+			fclose(parts[i]);
+		}
+	}
+	batchFree(&b);
+
+	// clean up
+
+	closeRelation(r);
+
+	return 0;
+}
@@ -11,12 +11,15 @@
 
 // convert a a,b:a,b:a,b:...:a,b" representation
 //  of a choice vector into a ChVec
-// if string doesn't specify all 32 bits, then
-//  cycle through attributes until reach 32 bits
+// if string doesn't specify all of r's address bits, then
+//  cycle through attributes until reach them all
+// bits of attribute hashes are limited to 32 for 32-bit addresses,
+//  and to the width of the hash function otherwise (see hash.h)
 
 Status parseChVec(Reln r, char *str, ChVec cv)
 {
-	Count i = 0, nattr = nattrs(r);
+	Count i = 0, nattr = nattrs(r), nbits = addrBits(r);
+	Count width = (nbits == 32) ? 32 : hashWidth(hashId(r));
 	char *c = str, *c0 = str;
 	while (*c != '\0') {
 		while (*c != ':' && *c != '\0') c++;
@@ -25,7 +28,7 @@ Status parseChVec(Reln r, char *str, ChVec cv)
 			n = sscanf(c0, "%d,%d", &a, &b);
 			// is the (attr,bit) pair valid?
 			// neither a nor b can be < 0 because they're unsigned
-			if (n != 2 || a >= nattr || b >= 32) {
+			if (n != 2 || a >= nattr || b >= width || i >= nbits) {
 				printf("Invalid choice vector element: (att:%d,bit:%d)\n",a,b);
 				return ~OK;
 			}
@@ -33,7 +36,7 @@ Status parseChVec(Reln r, char *str, ChVec cv)
 		else {
 			*c = '\0';
 			n = sscanf(c0, "%d,%d", &a, &b);
-			if (n != 2 || a >= nattr || b >= 32) {
+			if (n != 2 || a >= nattr || b >= width || i >= nbits) {
 				printf("Invalid choice vector element: (att:%d,bit:%d)\n",a,b);
                 return ~OK;
             }
@@ -43,29 +46,207 @@ Status parseChVec(Reln r, char *str, ChVec cv)
 		printf("cv[%d] is (%d,%d)\n", i, cv[i].att, cv[i].bit);
 		i++;
 	}
-	// get enough bits for a 32-bit choice vector
+	// get enough bits for the whole choice vector
 	// take new bits from top end of each hash,
 	//   so as to hopefully not conflict 
 	Count x;  Count next[MAXCHVEC];
-	for (x = 0; x < MAXCHVEC; x++) next[x] = 31;
+	for (x = 0; x < MAXCHVEC; x++) next[x] = width-1;
 	x = 0;
-	while (i < MAXCHVEC) {
+	while (i < nbits) {
 		cv[i].att = x; cv[i].bit = next[x];
 		printf("cv[%d] is (%d,%d)\n", i, cv[i].att, cv[i].bit);
-		next[x]--;
+		next[x] = (next[x] == 0) ? width-1 : next[x]-1;
 		i++; x = (x+1) % nattr;
 	}
+	// unused entries
+	for (; i < MAXCHVEC; i++) cv[i].att = cv[i].bit = 0;
 	return OK;
 }
 
-// print a choice vector (for debugging)
+// A tuple's hash takes bit cv[i].bit of the hash of attribute
+//  cv[i].att as its bit i
+// compileChVec() turns the first nbits entries of cv into steps
+//  that move many of these bits at once, in two forms:
+// - pext/pdep steps, on CPUs with BMI2: pext packs the chosen bits
+//   of an attribute hash together, in order, and pdep spreads them
+//   out to where they go; this only works if the bits keep their
+//   order, so each attribute's bits are split into runs that do,
+//   using the hash reversed if that needs fewer runs (as for the
+//   default choice vector, which takes bits from the top down)
+// - table steps: a table for each byte of each attribute hash
+//   that gives the tuple hash bits it sets
+// Both are made, and pext/pdep is used if the CPU has it and the
+//  plan needs fewer of its steps, counting a reversal as two
+//  (see hashbench.c for the timings behind this)
+// Only attributes that cv uses are hashed (see tuple.c); the
+//  others (e.g. if cv takes all its bits from two attributes)
+//  never affect where a tuple goes
 
-void printChVec(ChVec cv)
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_PEXT 1
+#include <immintrin.h>
+#endif
+
+// does this CPU have fast pext/pdep?
+// (AMD CPUs before Zen 3 have them, but they're very slow)
+
+Bool pextAvailable(void)
+{
+#ifdef HAVE_PEXT
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1")
+	       && !__builtin_cpu_is("znver2");
+#else
+	return FALSE;
+#endif
+}
+
+static Bits reverseBits(Bits x)
+{
+	x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+	x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f0f0f0f0full) | ((x & 0x0f0f0f0f0f0f0f0full) << 4);
+	x = ((x >> 8) & 0x00ff00ff00ff00ffull) | ((x & 0x00ff00ff00ff00ffull) << 8);
+	x = ((x >> 16) & 0x0000ffff0000ffffull) | ((x & 0x0000ffff0000ffffull) << 16);
+	return (x >> 32) | (x << 32);
+}
+
+// split the bits that attribute a gives to the first nbits bits
+//  of the hash into runs whose source bits increase (in the hash
+//  reversed, if rev), adding a step for each run to plan
+// returns the #steps added
+
+static Count addSteps(ChVec cv, Count nbits, Byte a, Bool rev, HashPlan *plan)
+{
+	Count first = plan->nsteps, i, j;
+	int last[MAXCHVEC];  // top source bit of each run so far
+	for (i = 0; i < nbits; i++) {
+		if (cv[i].att != a) continue;
+		int b = rev ? 63 - cv[i].bit : cv[i].bit;
+		for (j = first; j < plan->nsteps; j++)
+			if (last[j-first] < b) break;
+		if (j == plan->nsteps) {
+			HashStep *s = &plan->step[plan->nsteps++];
+			s->att = a; s->rev = rev; s->from = s->to = 0;
+		}
+		plan->step[j].from |= (Bits)1 << b;
+		plan->step[j].to |= (Bits)1 << i;
+		last[j-first] = b;
+	}
+	return plan->nsteps - first;
+}
+
+void compileChVec(ChVec cv, Count nbits, HashPlan *plan)
+{
+	Bool used[256] = { FALSE };
+	Count i, k;
+	for (i = 0; i < nbits; i++) used[cv[i].att] = TRUE;
+	plan->natts = 0;
+	for (i = 0; i < 256; i++)
+		if (used[i]) plan->atts[plan->natts++] = i;
+
+	// pext/pdep steps, with each hash forwards or reversed
+	plan->nsteps = 0;
+	for (k = 0; k < plan->natts; k++) {
+		Byte a = plan->atts[k];
+		Count n = addSteps(cv, nbits, a, FALSE, plan);
+		plan->nsteps -= n;
+		Count nrev = addSteps(cv, nbits, a, TRUE, plan);
+		if (nrev > n) {
+			plan->nsteps -= nrev;
+			addSteps(cv, nbits, a, FALSE, plan);
+		}
+		plan->to[k] = 0;
+		for (i = 0; i < nbits; i++)
+			if (cv[i].att == a) plan->to[k] |= (Bits)1 << i;
+	}
+
+	// table steps, for each byte of each hash that has bits in cv
+	Byte bytes[256] = { 0 };  // bit j set if byte j of hash is used
+	for (i = 0; i < nbits; i++) bytes[cv[i].att] |= 1 << (cv[i].bit/8);
+	plan->nparts = 0;
+	for (k = 0; k < plan->natts; k++)
+		for (i = 0; i < 8; i++)
+			if (bytes[plan->atts[k]] & (1 << i)) plan->nparts++;
+	plan->tables = calloc(plan->nparts*256, sizeof(Bits));
+	assert(plan->tables != NULL);
+	plan->nparts = 0;
+	for (k = 0; k < plan->natts; k++) {
+		Byte a = plan->atts[k];
+		Count byte;
+		for (byte = 0; byte < 8; byte++) {
+			if (!(bytes[a] & (1 << byte))) continue;
+			HashPart *p = &plan->part[plan->nparts];
+			p->att = a; p->shift = 8*byte;
+			p->table = plan->tables + 256*plan->nparts;
+			plan->nparts++;
+			for (i = 0; i < nbits; i++) {
+				if (cv[i].att != a || cv[i].bit/8 != byte) continue;
+				Count v, b = cv[i].bit % 8;
+				for (v = 0; v < 256; v++)
+					if (v & (1 << b)) p->table[v] |= (Bits)1 << i;
+			}
+		}
+	}
+
+	Count cost = plan->nsteps;
+	for (i = 0; i < plan->nsteps; i++)
+		if (plan->step[i].rev) cost += 2;
+	plan->usepext = pextAvailable() && cost < plan->nparts;
+}
+
+void freeHashPlan(HashPlan *plan)
+{
+	free(plan->tables);
+	plan->tables = NULL;
+}
+
+#ifdef HAVE_PEXT
+__attribute__((target("bmi2")))
+static Bits pextGather(HashPlan *plan, Bits *hashval)
+{
+	Bits hash = 0;
+	Count i;
+	for (i = 0; i < plan->nsteps; i++) {
+		HashStep *s = &plan->step[i];
+		Bits h = s->rev ? reverseBits(hashval[s->att]) : hashval[s->att];
+		hash |= _pdep_u64(_pext_u64(h, s->from), s->to);
+	}
+	return hash;
+}
+#endif
+
+static Bits tableGather(HashPlan *plan, Bits *hashval)
+{
+	Bits hash = 0;
+	Count i;
+	for (i = 0; i < plan->nparts; i++) {
+		HashPart *p = &plan->part[i];
+		hash |= p->table[(hashval[p->att] >> p->shift) & 0xff];
+	}
+	return hash;
+}
+
+// make a tuple's hash from the hashes of its attributes
+// hashval[a] is the hash of attribute a; only those in plan->atts
+//  are looked at
+
+Bits gatherBits(HashPlan *plan, Bits *hashval)
+{
+#ifdef HAVE_PEXT
+	if (plan->usepext) return pextGather(plan, hashval);
+#endif
+	return tableGather(plan, hashval);
+}
+
+// print the first n entries of a choice vector (for debugging)
+
+void printChVec(ChVec cv, Count n)
 {
 	int i;
-	for (i = 0; i < MAXCHVEC; i++) {
+	for (i = 0; i < n; i++) {
 		printf("%d,%d",cv[i].att, cv[i].bit);
-		if (i < MAXCHVEC-1) putchar(':');
+		if (i < n-1) putchar(':');
 	}
 	printf("\n");
 }
@@ -2,6 +2,7 @@
 // part of Multi-attribute Linear-hashed Files
 // A ChVec is an array of MAXCHVEC ChVecItems
 // Each ChVecItem is a pair (attr#,bit#)
+// Relations with 32-bit addresses only use the first 32
 // See chvec.c for details on functions
 // Last modified by John Shepherd, July 2019
 
@@ -9,15 +10,44 @@
 #define CHVEC_H 1
 
 #include "defs.h"
+#include "bits.h"
 #include "reln.h"
 
-#define MAXCHVEC 32
+#define MAXCHVEC 64
 
 typedef struct _ChVecItem { Byte att; Byte bit; } ChVecItem;
 
 typedef ChVecItem ChVec[MAXCHVEC];
 
+// A choice vector is compiled into a HashPlan (see compileChVec()),
+//  which makes a tuple's hash from its attribute hashes a few bits
+//  at a time, rather than one bit at a time
+
+// one pext/pdep step: bits from of an attribute's hash (bit-reversed
+//  first if rev) go, in order, to bits to of the tuple's hash
+typedef struct _HashStep { Byte att; Byte rev; Bits from; Bits to; } HashStep;
+
+// one table step: byte shift/8 of an attribute's hash indexes a
+//  256-entry table of the tuple hash bits that it sets
+typedef struct _HashPart { Byte att; Byte shift; Bits *table; } HashPart;
+
+typedef struct _HashPlan {
+	Count natts;           // #attributes to hash
+	Byte  atts[MAXCHVEC];  // those attributes, in increasing order
+	Bits  to[MAXCHVEC];    // bits of the tuple's hash made from each
+	Bool  usepext;         // gather with pext/pdep, or with tables?
+	Count nsteps;          // pext/pdep steps
+	HashStep step[MAXCHVEC];
+	Count nparts;          // table steps
+	HashPart part[MAXCHVEC];
+	Bits *tables;          // nparts tables, for the table steps
+} HashPlan;
+
 Status parseChVec(Reln r, char *str, ChVec cv);
-void printChVec(ChVec cv);
+void compileChVec(ChVec cv, Count nbits, HashPlan *plan);
+void freeHashPlan(HashPlan *plan);
+Bool pextAvailable(void);
+Bits gatherBits(HashPlan *plan, Bits *hashval);
+void printChVec(ChVec cv, Count n);
 
 #endif
@@ -1,10 +1,20 @@
 // create.c ... create an empty Relation
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named file
-// Usage:  ./create  [-v]  RelName  #attrs  #pages  ChoiceVector
+// Usage:  ./create  [-v]  [-p PageSize]  [-s Policy]  [-h Hash]  [-a Bits]  RelName  #attrs  #pages  ChoiceVector
 // where #attrs = # of attributes in each tuple
 //	   #pages = initial (empty) pages in File
 //	   ChoiceVector = attr,bit:attr,bit:...
+//	   PageSize = bytes per page, e.g. 1024, 4K, 8K, 16K, 64K
+//	   Policy = when to split buckets, one of
+//	      every[:K]   split every K inserts
+//	      load[:P]    split when tuples fill over P% of primary pages
+//	      ovflow      split when an insert adds an overflow page
+//	   Hash = how attribute values are hashed, wyhash (default)
+//	      or lookup2 (the hash used by older relations)
+//	   Bits = #bits in hashes and page ids, 32 (default) or 64;
+//	      64 takes more space per tuple, but lets the file grow
+//	      past 2^32 buckets or overflow pages
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,7 +22,7 @@
 #include "util.h"
 #include "reln.h"
 
-#define USAGE "./create  [-v]  RelName  #attrs  #pages  ChoiceVector"
+#define USAGE "./create  [-v]  [-p PageSize]  [-s Policy]  [-h Hash]  [-a Bits]  RelName  #attrs  #pages  ChoiceVector"
 
 
 // Main ... process args, create relation
@@ -28,17 +38,73 @@ int main(int argc, char **argv)
 	char *attrs;   // number of attributes in tuples
 	char *pages;   // number of pages in data file
 	char *cv;	  // choice vector
+	int pagesize;  // bytes per page
+	char *policy;  // split policy, as given
+	int param;     // parameter for split policy (0 for default)
+	char *hash;    // name of hash function
+	int addrbits;  // #bits in hashes and page ids
 
 	// Process command-line args
 
-	if (argc < 2) fatal(USAGE);
-	if (strcmp(argv[1], "-v") == 0) {
-		if (argc < 6) fatal(USAGE);
-	    verbose = 1; rname = argv[2]; attrs = argv[3]; pages = argv[4]; cv = argv[5];
+	int a = 1;
+	verbose = 0; pagesize = PAGESIZE; policy = "every"; param = 0;
+	hash = "wyhash"; addrbits = 32;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-p") == 0 && a+1 < argc) {
+			char *k;
+			pagesize = strtol(argv[++a], &k, 10);
+			if (*k == 'K' || *k == 'k') pagesize *= 1024;
+		}
+		else if (strcmp(argv[a], "-s") == 0 && a+1 < argc) {
+			policy = argv[++a];
+			char *c = strchr(policy, ':');
+			if (c != NULL) {
+				*c = '\0';
+				param = atoi(c+1);
+				if (param < 1) fatal(USAGE);
+			}
+		}
+		else if (strcmp(argv[a], "-h") == 0 && a+1 < argc)
+			hash = argv[++a];
+		else if (strcmp(argv[a], "-a") == 0 && a+1 < argc) {
+			addrbits = atoi(argv[++a]);
+			if (addrbits != 32 && addrbits != 64) fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+		a++;
 	}
+	if (argc - a < 4) fatal(USAGE);
+	rname = argv[a]; attrs = argv[a+1]; pages = argv[a+2]; cv = argv[a+3];
+
+	// how big is each page
+	if (pagesize < MINPAGESIZE || pagesize > MAXPAGESIZE
+	    || (pagesize & (pagesize-1)) != 0) {
+		sprintf(err, "Invalid page size: %d (must be power of 2, %d..%d)",
+		        pagesize, MINPAGESIZE, MAXPAGESIZE);
+		fatal(err);
+	}
+
+	// when to split buckets
+	int pol = SPLIT_EVERY;
+	if (strcmp(policy, "every") == 0)
+		pol = SPLIT_EVERY;
+	else if (strcmp(policy, "load") == 0)
+		pol = SPLIT_LOAD;
+	else if (strcmp(policy, "ovflow") == 0 && param == 0)
+		pol = SPLIT_OVFLOW;
 	else {
-		if (argc < 5) fatal(USAGE);
-	    verbose = 0; rname = argv[1]; attrs = argv[2]; pages = argv[3]; cv = argv[4];
+		sprintf(err, "Invalid split policy: %s", policy);
+		fatal(err);
+	}
+
+	// how to hash attribute values
+	int hashid = hashByName(hash);
+	if (hashid < 0) {
+		sprintf(err, "Invalid hash function: %s", hash);
+		fatal(err);
 	}
 
 	// how many attributes in each tuple
@@ -60,7 +126,7 @@ int main(int argc, char **argv)
 	while (np < npages) { d++; np <<= 1; }
 
 	if (verbose)
-		printf("#a=%d, #p=%d, d=%d\n", nattrs, np, d);
+		printf("#a=%d, #p=%d, d=%d, pagesize=%d\n", nattrs, np, d, pagesize);
 
 	// Open files for the Relation and initialise
 
@@ -68,7 +134,7 @@ int main(int argc, char **argv)
 		sprintf(err, "Relation %s already exists", rname);
 		fatal(err);
 	}
-	if (newRelation(rname, nattrs, np, d, cv) != OK) {
+	if (newRelation(rname, nattrs, np, d, cv, pagesize, pol, param, hashid, addrbits) != OK) {
 		sprintf(err, "Problems while creating relation %s", rname);
 		fatal(err);
 	}
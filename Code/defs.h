@@ -13,12 +13,14 @@
 #include "util.h"
 
 #define PAGESIZE    1024
-#define NO_PAGE     0xffffffff
+#define MINPAGESIZE 1024
+#define MAXPAGESIZE 65536
+#define NO_PAGE     0xfffffffffffffffful
 #define MAXERRMSG   200
 #define MAXTUPLEN   200
 #define MAXRELNAME  200
 #define MAXFILENAME MAXRELNAME+8
-#define MAXBITS     32
+#define MAXBITS     64
 #define OK          0
 #define TRUE        1
 #define FALSE       0
@@ -28,6 +30,8 @@ typedef unsigned char Byte;
 typedef int Status;
 typedef unsigned int Offset;
 typedef unsigned int Count;
-typedef Offset PageID;
+// page ids and relation-wide counts need 64 bits (see reln.c)
+typedef unsigned long PageID;
+typedef unsigned long Total;
 
 #endif
@@ -25,12 +25,12 @@ int main(int argc, char **argv)
 
 	if (!existsRelation(relname))
 		fatal("No such relation");
-	Reln r = openRelation(relname,"r");
+	Reln r = openRelation(relname,"rm");
 	if (r == NULL)
 		fatal("Can't open relation");
 
-	for (Offset pid = 0; pid < npages(r); pid++) {
-		printf("Bucket[%d]\n",pid);
+	for (PageID pid = 0; pid < npages(r); pid++) {
+		printf("Bucket[%lu]\n",pid);
 		// show tuples in data file
 		Page pg = getPage(dataFile(r),pid);
 		showAllTuples(pg);
@@ -42,9 +42,9 @@ int main(int argc, char **argv)
 			ovpg = getPage(ovflowFile(r), ovp);
 			showAllTuples(ovpg);
 			ovp = pageOvflow(ovpg);
-			free(ovpg);
+			releasePage(ovpg);
 		}
-		free(pg);
+		releasePage(pg);
 	}
 	closeRelation(r);
 
@@ -55,10 +55,10 @@ int main(int argc, char **argv)
 
 void showAllTuples(Page pg)
 {
+		char buf[MAXTUPLEN];
 		Count ntups = pageNTuples(pg);
-		char *c = pageData(pg);
 		for (int i = 0; i < ntups; i++) {
-			printf("%s\n", c);
-			c += strlen(c) + 1;
+			tupleString(pageTuple(pg, i), buf);
+			printf("%s\n", buf);
 		}
 }
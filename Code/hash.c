@@ -1,5 +1,6 @@
-// hash.c ... hash function (from PostgreSQL)
+// hash.c ... hash functions
 // part of Multi-attribute Linear-hashed Files
+// hash_any() is from PostgreSQL; see the end for the others
 // Last modified by John Shepherd, July 2019
 
 #include "defs.h"
@@ -29,10 +30,10 @@
   c ^= b; c -= rot(b,24); \
 }
 
-Bits
+uint32_t
 hash_any(unsigned char *k, int keylen)
 {
-	Bits a, b, c, len;
+	uint32_t a, b, c, len;
 	/* set up the internal state */
 	len = keylen;
 	a = b = 0x9e3779b9;
@@ -42,13 +43,13 @@ hash_any(unsigned char *k, int keylen)
 	while (len >= 12)
 	{
 #ifdef WORDS_BIGENDIAN
-		a += (k[3] + ((Bits) k[2] << 8) + ((Bits) k[1] << 16) + ((Bits) k[0] << 24));
-		b += (k[7] + ((Bits) k[6] << 8) + ((Bits) k[5] << 16) + ((Bits) k[4] << 24));
-		c += (k[11] + ((Bits) k[10] << 8) + ((Bits) k[9] << 16) + ((Bits) k[8] << 24));
+		a += (k[3] + ((uint32_t) k[2] << 8) + ((uint32_t) k[1] << 16) + ((uint32_t) k[0] << 24));
+		b += (k[7] + ((uint32_t) k[6] << 8) + ((uint32_t) k[5] << 16) + ((uint32_t) k[4] << 24));
+		c += (k[11] + ((uint32_t) k[10] << 8) + ((uint32_t) k[9] << 16) + ((uint32_t) k[8] << 24));
 #else							/* !WORDS_BIGENDIAN */
-		a += (k[0] + ((Bits) k[1] << 8) + ((Bits) k[2] << 16) + ((Bits) k[3] << 24));
-		b += (k[4] + ((Bits) k[5] << 8) + ((Bits) k[6] << 16) + ((Bits) k[7] << 24));
-		c += (k[8] + ((Bits) k[9] << 8) + ((Bits) k[10] << 16) + ((Bits) k[11] << 24));
+		a += (k[0] + ((uint32_t) k[1] << 8) + ((uint32_t) k[2] << 16) + ((uint32_t) k[3] << 24));
+		b += (k[4] + ((uint32_t) k[5] << 8) + ((uint32_t) k[6] << 16) + ((uint32_t) k[7] << 24));
+		c += (k[8] + ((uint32_t) k[9] << 8) + ((uint32_t) k[10] << 16) + ((uint32_t) k[11] << 24));
 #endif   /* WORDS_BIGENDIAN */
 		mix(a, b, c);
 		k += 12;
@@ -59,34 +60,34 @@ hash_any(unsigned char *k, int keylen)
 #ifdef WORDS_BIGENDIAN
 	switch (len)			/* all the case statements fall through */
 	{
-		case 11: c += ((Bits) k[10] << 8);
-		case 10: c += ((Bits) k[9] << 16);
-		case 9: c += ((Bits) k[8] << 24);
+		case 11: c += ((uint32_t) k[10] << 8);
+		case 10: c += ((uint32_t) k[9] << 16);
+		case 9: c += ((uint32_t) k[8] << 24);
 			/* the lowest byte of c is reserved for the length */
 		case 8: b += k[7];
-		case 7: b += ((Bits) k[6] << 8);
-		case 6: b += ((Bits) k[5] << 16);
-		case 5: b += ((Bits) k[4] << 24);
+		case 7: b += ((uint32_t) k[6] << 8);
+		case 6: b += ((uint32_t) k[5] << 16);
+		case 5: b += ((uint32_t) k[4] << 24);
 		case 4: a += k[3];
-		case 3: a += ((Bits) k[2] << 8);
-		case 2: a += ((Bits) k[1] << 16);
-		case 1: a += ((Bits) k[0] << 24);
+		case 3: a += ((uint32_t) k[2] << 8);
+		case 2: a += ((uint32_t) k[1] << 16);
+		case 1: a += ((uint32_t) k[0] << 24);
 		/* case 0: nothing left to add */
 	}
 #else							/* !WORDS_BIGENDIAN */
 	switch (len)			/* all the case statements fall through */
 	{
-		case 11: c += ((Bits) k[10] << 24);
-		case 10: c += ((Bits) k[9] << 16);
-		case 9: c += ((Bits) k[8] << 8);
+		case 11: c += ((uint32_t) k[10] << 24);
+		case 10: c += ((uint32_t) k[9] << 16);
+		case 9: c += ((uint32_t) k[8] << 8);
 			/* the lowest byte of c is reserved for the length */
-		case 8: b += ((Bits) k[7] << 24);
-		case 7: b += ((Bits) k[6] << 16);
-		case 6: b += ((Bits) k[5] << 8);
+		case 8: b += ((uint32_t) k[7] << 24);
+		case 7: b += ((uint32_t) k[6] << 16);
+		case 6: b += ((uint32_t) k[5] << 8);
 		case 5: b += k[4];
-		case 4: a += ((Bits) k[3] << 24);
-		case 3: a += ((Bits) k[2] << 16);
-		case 2: a += ((Bits) k[1] << 8);
+		case 4: a += ((uint32_t) k[3] << 24);
+		case 3: a += ((uint32_t) k[2] << 16);
+		case 2: a += ((uint32_t) k[1] << 8);
 		case 1: a += k[0];
 		/* case 0: nothing left to add */
 	}
@@ -95,3 +96,262 @@ hash_any(unsigned char *k, int keylen)
 	final(a, b, c);
 	return c;
 }
+
+// hash_any(), as a 64-bit hash function (the top 32 bits are 0)
+
+uint64_t hashLookup2(unsigned char *k, int keylen)
+{
+	return hash_any(k, keylen);
+}
+
+// wyhash (Wang Yi's final version, with seed 0), which reads whole
+//  words and mixes them with a 64x64->128 bit multiply
+// Attribute values are mostly under 16 bytes, so most hashes take
+//  two multiplies, against lookup2's byte-at-a-time loads and
+//  ~40 shift/add steps
+
+// the helpers are inlined even without -O (see Makefile)
+#define WYINLINE static inline __attribute__((always_inline))
+
+static const uint64_t wysecret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+	0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+WYINLINE void wymum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r; *b = (uint64_t)(r >> 64);
+}
+
+WYINLINE uint64_t wymix(uint64_t a, uint64_t b)
+{
+	wymum(&a, &b);
+	return a ^ b;
+}
+
+// little-endian loads of 8, 4 and 1..3 bytes
+WYINLINE uint64_t wyr8(unsigned char *p)
+{
+	uint64_t v; memcpy(&v, p, 8); return v;
+}
+WYINLINE uint64_t wyr4(unsigned char *p)
+{
+	uint32_t v; memcpy(&v, p, 4); return v;
+}
+WYINLINE uint64_t wyr3(unsigned char *p, int k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k>>1] << 8) | p[k-1];
+}
+
+uint64_t hashWy(unsigned char *p, int keylen)
+{
+	uint64_t len = keylen, a, b;
+	uint64_t seed = wymix(wysecret[0], wysecret[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyr4(p) << 32) | wyr4(p + ((len>>3)<<2));
+			b = (wyr4(p+len-4) << 32) | wyr4(p+len-4 - ((len>>3)<<2));
+		}
+		else if (len > 0) {
+			a = wyr3(p, len); b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else {
+		uint64_t i = len;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wymix(wyr8(p) ^ wysecret[1], wyr8(p+8) ^ seed);
+				see1 = wymix(wyr8(p+16) ^ wysecret[2], wyr8(p+24) ^ see1);
+				see2 = wymix(wyr8(p+32) ^ wysecret[3], wyr8(p+40) ^ see2);
+				p += 48; i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wymix(wyr8(p) ^ wysecret[1], wyr8(p+8) ^ seed);
+			p += 16; i -= 16;
+		}
+		a = wyr8(p+i-16); b = wyr8(p+i-8);
+	}
+	a ^= wysecret[1]; b ^= seed;
+	wymum(&a, &b);
+	return wymix(a ^ wysecret[0] ^ len, b ^ wysecret[1]);
+}
+
+// hash_any() on eight values at once, one in each 32-bit lane of
+//  an AVX2 register; gives the same hashes as hash_any()
+// Each lane's 12-byte blocks and tail are loaded from its value
+//  into a buffer, and a lane that has run out of blocks keeps its
+//  state while the others go on mixing
+
+// The Makefile builds without -O, and unoptimised the intrinsics
+//  are slower than hash_any(), so hashLookup2x8() is always compiled
+//  with -O2 (it is the only function in this file that is)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+
+#define vrot(x,k) _mm256_or_si256(_mm256_slli_epi32(x,k), _mm256_srli_epi32(x,32-(k)))
+#define vstep(x,y,k) \
+	{ x = _mm256_sub_epi32(x, y); x = _mm256_xor_si256(x, vrot(y,k)); }
+
+#define vmix(a,b,c) \
+{ \
+  vstep(a,c, 4);  c = _mm256_add_epi32(c, b); \
+  vstep(b,a, 6);  a = _mm256_add_epi32(a, c); \
+  vstep(c,b, 8);  b = _mm256_add_epi32(b, a); \
+  vstep(a,c,16);  c = _mm256_add_epi32(c, b); \
+  vstep(b,a,19);  a = _mm256_add_epi32(a, c); \
+  vstep(c,b, 4);  b = _mm256_add_epi32(b, a); \
+}
+
+#define vfin(x,y,k) \
+	{ x = _mm256_xor_si256(x, y); x = _mm256_sub_epi32(x, vrot(y,k)); }
+
+#define vfinal(a,b,c) \
+{ \
+  vfin(c,b,14); vfin(a,c,11); vfin(b,a,25); vfin(c,b,16); \
+  vfin(a,c, 4); vfin(b,a,14); vfin(c,b,24); \
+}
+
+// the last len (< 12) bytes of a value, as three little-endian
+//  words, using fixed-size loads that stay inside the value
+
+WYINLINE void lookup2Tail(unsigned char *p, int len, uint32_t *w)
+{
+	uint64_t lo = 0, hi = 0;
+	if (len >= 8) {
+		lo = wyr8(p);
+		if (len > 8) hi = wyr4(p+len-4) >> (8*(12-len));
+	}
+	else if (len >= 4)
+		lo = wyr4(p) | ((wyr4(p+len-4) >> (8*(8-len))) << 32);
+	else if (len > 0)
+		lo = p[0] | ((uint64_t)p[len>>1] << (8*(len>>1)))
+		     | ((uint64_t)p[len-1] << (8*(len-1)));
+	w[0] = lo; w[1] = lo >> 32; w[2] = hi;
+}
+
+__attribute__((target("avx2"), optimize("O2")))
+static void hashLookup2x8(unsigned char **k, int *keylen, uint64_t *out)
+{
+	uint32_t w[3][8], h[8], t[3];
+	int done[8], more, i;
+	__m256i a, b, c, na, nb, nc, busy;
+	a = b = _mm256_set1_epi32(0x9e3779b9);
+	c = _mm256_set1_epi32(3923095);
+	for (i = 0; i < 8; i++) done[i] = 0;
+
+	// 12-byte blocks, while any lane has one
+	for (;;) {
+		more = 0;
+		for (i = 0; i < 8; i++) {
+			if (keylen[i] - done[i] >= 12) {
+				w[0][i] = wyr4(k[i]+done[i]);
+				w[1][i] = wyr4(k[i]+done[i]+4);
+				w[2][i] = wyr4(k[i]+done[i]+8);
+				done[i] += 12;
+				h[i] = 0xffffffff; more = 1;
+			}
+			else
+				w[0][i] = w[1][i] = w[2][i] = h[i] = 0;
+		}
+		if (!more) break;
+		na = _mm256_add_epi32(a, _mm256_loadu_si256((__m256i *)w[0]));
+		nb = _mm256_add_epi32(b, _mm256_loadu_si256((__m256i *)w[1]));
+		nc = _mm256_add_epi32(c, _mm256_loadu_si256((__m256i *)w[2]));
+		vmix(na, nb, nc);
+		busy = _mm256_loadu_si256((__m256i *)h);
+		a = _mm256_blendv_epi8(a, na, busy);
+		b = _mm256_blendv_epi8(b, nb, busy);
+		c = _mm256_blendv_epi8(c, nc, busy);
+	}
+
+	// the last 11 bytes; the lowest byte of c is left for the length
+	for (i = 0; i < 8; i++) {
+		lookup2Tail(k[i]+done[i], keylen[i]-done[i], t);
+		w[0][i] = t[0]; w[1][i] = t[1]; w[2][i] = t[2] << 8;
+	}
+	a = _mm256_add_epi32(a, _mm256_loadu_si256((__m256i *)w[0]));
+	b = _mm256_add_epi32(b, _mm256_loadu_si256((__m256i *)w[1]));
+	c = _mm256_add_epi32(c, _mm256_loadu_si256((__m256i *)w[2]));
+	vfinal(a, b, c);
+	_mm256_storeu_si256((__m256i *)h, c);
+	for (i = 0; i < 8; i++) out[i] = h[i];
+}
+#endif
+
+// can this CPU run the AVX2 code above?
+
+Bool avx2Available(void)
+{
+#if defined(HAVE_AVX2) && !defined(WORDS_BIGENDIAN)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return FALSE;
+#endif
+}
+
+// the hash functions, indexed by the ids stored in relations
+
+static struct {
+	char  *name;
+	HashFn fn;
+	Count  width; // #bits of hash
+} hashes[NHASHES] = {
+	{ "lookup2", hashLookup2, 32 },
+	{ "wyhash",  hashWy,      64 },
+};
+
+HashFn hashFunction(Count id)
+{
+	assert(id < NHASHES);
+	return hashes[id].fn;
+}
+
+Count hashWidth(Count id)
+{
+	assert(id < NHASHES);
+	return hashes[id].width;
+}
+
+// hash n values at once, with hash function id, putting the
+//  hashes in out; the hashes are the same as hashFunction(id) gives
+// lookup2 uses AVX2 if the CPU has it; wyhash never does, as AVX2
+//  has no 64x64->128 bit multiply, so relations made with wyhash
+//  hash one value at a time
+
+void hashBatch(Count id, unsigned char **vals, int *lens, Count n, uint64_t *out)
+{
+	Count i = 0;
+	assert(id < NHASHES);
+#ifdef HAVE_AVX2
+	if (id == HASH_LOOKUP2 && avx2Available())
+		for (; i+8 <= n; i += 8)
+			hashLookup2x8(vals+i, lens+i, out+i);
+#endif
+	for (; i < n; i++)
+		out[i] = hashes[id].fn(vals[i], lens[i]);
+}
+
+char *hashName(Count id)
+{
+	return (id < NHASHES) ? hashes[id].name : "unknown";
+}
+
+// id of the hash function called name, or -1 if there is none
+
+int hashByName(char *name)
+{
+	int i;
+	for (i = 0; i < NHASHES; i++)
+		if (strcmp(hashes[i].name, name) == 0) return i;
+	return -1;
+}
@@ -1,13 +1,31 @@
-// hash.h ... interface to hash function
+// hash.h ... interface to hash functions
 // part of Multi-attribute Linear-hashed Files
-// Hash function from PostgreSQL
+// hash_any() is the hash function from PostgreSQL
+// Relations record which hash function they use (see reln.c)
 // Last modified by John Shepherd, July 2019
 
 #ifndef HASH_H
 #define HASH_H 1
 
+#include <stdint.h>
+#include "defs.h"
 #include "bits.h"
 
-Bits hash_any(unsigned char *, int);
+// hash functions that relations can use
+#define HASH_LOOKUP2 0  // hash_any(), used by all older relations
+#define HASH_WYHASH  1  // wyhash, much faster on short values
+#define NHASHES      2
+
+typedef uint64_t (*HashFn)(unsigned char *, int);
+
+uint32_t hash_any(unsigned char *, int);
+uint64_t hashLookup2(unsigned char *, int);
+uint64_t hashWy(unsigned char *, int);
+HashFn hashFunction(Count id);
+Count hashWidth(Count id);
+void hashBatch(Count id, unsigned char **vals, int *lens, Count n, uint64_t *out);
+Bool avx2Available(void);
+char *hashName(Count id);
+int hashByName(char *name);
 
 #endif
@@ -0,0 +1,201 @@
+// hashbench.c ... compare the speed of the hash functions
+// part of Multi-attribute linear-hashed files
+// Reads tuples (e.g. from gendata) from stdin and hashes every
+//  attribute value with each hash function in hash.c, one at a
+//  time and in batches (see hashBatch()), then makes
+//  each tuple's hash from its attribute hashes, one bit at a time
+//  (as tupleHash() used to) and with a compiled choice vector
+//  (see chvec.c), for a relation with Bits-bit addresses
+// Usage:  ./hashbench  [-r Rounds]  [-a Bits]  <  Tuples
+// e.g.    ./gendata 50000 3 1 | ./hashbench
+
+// clock_gettime() is not in plain C99
+#define _GNU_SOURCE
+
+#include <time.h>
+#include "defs.h"
+#include "hash.h"
+#include "reln.h"
+
+#define USAGE "./hashbench  [-r Rounds]  [-a Bits]  <  Tuples"
+
+#define MAXLINE 1000
+#define BATCH   256  // values per hashBatch() call
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// the default choice vector, as made by parseChVec() from ""
+
+static void defaultChVec(ChVec cv, Count nattrs, Count nbits, Count width)
+{
+	Count i, x = 0, next[MAXCHVEC];
+	for (i = 0; i < MAXCHVEC; i++) next[i] = width-1;
+	for (i = 0; i < nbits; i++) {
+		cv[i].att = x; cv[i].bit = next[x];
+		next[x] = (next[x] == 0) ? width-1 : next[x]-1;
+		x = (x+1) % nattrs;
+	}
+	for (; i < MAXCHVEC; i++) cv[i].att = cv[i].bit = 0;
+}
+
+// make a tuple's hash a bit at a time, as tupleHash() used to
+
+static Bits bitwiseGather(ChVec cv, Count nbits, Bits *hashval)
+{
+	Bits hash = 0;
+	for (int i=0;i < nbits;i++) {
+		int result = bitIsSet(hashval[cv[i].att], cv[i].bit);
+		if (result == 1) {
+			hash = setBit(hash, i);
+		}
+		if (result == 0) {
+			hash = unsetBit(hash, i);
+		}
+	}
+	return hash;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 20;  // times to hash every value
+	Count nbits = 32;  // address bits
+	char line[MAXLINE];
+	Count nvals = 0, maxvals = 1 << 16, nbytes = 0, i;
+	Count natts = 0;  // #attributes in each tuple
+
+	int a;
+	for (a = 1; a < argc; a += 2) {
+		if (a+1 == argc) fatal(USAGE);
+		if (strcmp(argv[a], "-r") == 0)
+			rounds = atoi(argv[a+1]);
+		else if (strcmp(argv[a], "-a") == 0)
+			nbits = atoi(argv[a+1]);
+		else
+			fatal(USAGE);
+	}
+	if (rounds < 1 || (nbits != 32 && nbits != 64)) fatal(USAGE);
+
+	// read all values into one buffer, so only hashing is timed
+
+	char **vals = malloc(maxvals*sizeof(char *));
+	int *lens = malloc(maxvals*sizeof(int));
+	if (vals == NULL || lens == NULL) fatal("Out of memory");
+	while (fgets(line, MAXLINE, stdin) != NULL) {
+		char *c = line, *v;
+		Count n = 0;
+		line[strcspn(line, "\n")] = '\0';
+		while ((v = strsep(&c, ",")) != NULL) {
+			n++;
+			if (nvals == maxvals) {
+				maxvals *= 2;
+				vals = realloc(vals, maxvals*sizeof(char *));
+				lens = realloc(lens, maxvals*sizeof(int));
+				if (vals == NULL || lens == NULL) fatal("Out of memory");
+			}
+			if ((vals[nvals] = strdup(v)) == NULL) fatal("Out of memory");
+			lens[nvals] = strlen(v);
+			nbytes += lens[nvals];
+			nvals++;
+		}
+		if (natts == 0) natts = n;
+		if (n != natts || natts > MAXCHVEC)
+			fatal("Tuples must all have the same #attributes");
+	}
+	if (nvals == 0) fatal("No values to hash");
+	printf("%d values, %.1f bytes each, %d rounds\n",
+	       nvals, (double)nbytes/nvals, rounds);
+
+	// time each hash function over all values, one at a time and
+	//  BATCH at a time with hashBatch()
+	// (the sum of hashes stops the calls being optimised away)
+
+	printf("AVX2 %s\n", avx2Available() ? "available" : "not available");
+	Count id;
+	uint64_t out[BATCH];
+	for (id = 0; id < NHASHES; id++) {
+		HashFn hf = hashFunction(id);
+		int k, batched;
+		for (batched = 0; batched < 2; batched++) {
+			uint64_t sum = 0;
+			double t = now();
+			for (k = 0; k < rounds; k++)
+				for (i = 0; i < nvals; i += BATCH) {
+					Count j, m = (nvals - i < BATCH) ? nvals - i : BATCH;
+					if (batched)
+						hashBatch(id, (unsigned char **)vals+i, lens+i, m, out);
+					else
+						for (j = 0; j < m; j++)
+							out[j] = hf((unsigned char *)vals[i+j], lens[i+j]);
+					for (j = 0; j < m; j++) sum += out[j];
+				}
+			t = now() - t;
+			double n = (double)nvals*rounds;
+			printf("%-8s %-6s %7.2f ns/value  %8.1f MB/s  (sum %016llx)\n",
+			       hashName(id), batched ? "batch" : "single", t*1e9/n,
+			       nbytes*(double)rounds/t/1e6, (unsigned long long)sum);
+		}
+	}
+
+	// time making tuple hashes, with the default hash function
+	//  and choice vector, from attribute hashes and from scratch
+
+	Count hashid = HASH_WYHASH, ntups = nvals/natts;
+	Count width = (nbits == 32) ? 32 : hashWidth(hashid);
+	HashFn hf = hashFunction(hashid);
+	ChVec cv;
+	HashPlan plan;
+	defaultChVec(cv, natts, nbits, width);
+	compileChVec(cv, nbits, &plan);
+	Bits *hashes = malloc(nvals*sizeof(Bits));
+	if (hashes == NULL) fatal("Out of memory");
+	for (i = 0; i < nvals; i++)
+		hashes[i] = hf((unsigned char *)vals[i], lens[i]);
+	printf("%d tuples, %d attributes, %d-bit addresses, %d pext steps,"
+	       " %d table steps, using %s\n", ntups, natts, nbits, plan.nsteps,
+	       plan.nparts, plan.usepext ? "pext" : "tables");
+	char *methods[] = { "bitwise", "table", "pext" };
+	Count m;
+	for (m = 0; m < 3; m++) {
+		if (m == 2 && !pextAvailable()) {
+			printf("%-8s not available on this CPU\n", methods[m]);
+			continue;
+		}
+		plan.usepext = (m == 2);
+		double t[2];
+		uint64_t sum = 0;
+		int k, pass;
+		// pass 0 only gathers bits; pass 1 hashes attributes too
+		for (pass = 0; pass < 2; pass++) {
+			t[pass] = now();
+			for (k = 0; k < rounds; k++)
+				for (i = 0; i < ntups; i++) {
+					Bits hv[natts], *h = hashes + i*natts;
+					if (pass == 1) {
+						Count j;
+						for (j = 0; j < natts; j++)
+							hv[j] = hf((unsigned char *)vals[i*natts+j],
+							           lens[i*natts+j]);
+						h = hv;
+					}
+					sum += (m == 0) ? bitwiseGather(cv, nbits, h)
+					                : gatherBits(&plan, h);
+				}
+			t[pass] = now() - t[pass];
+		}
+		double n = (double)ntups*rounds;
+		printf("%-8s %7.2f ns/tuple to gather, %7.2f ns/tuple in all"
+		       "  (sum %016llx)\n", methods[m], t[0]*1e9/n, t[1]*1e9/n,
+		       (unsigned long long)sum);
+	}
+	freeHashPlan(&plan);
+	free(hashes);
+
+	for (i = 0; i < nvals; i++) free(vals[i]);
+	free(vals); free(lens);
+	return 0;
+}
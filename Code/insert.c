@@ -1,14 +1,225 @@
 // insert.c ... add tuples to a relation
 // part of Multi-attribute linear-hashed files
 // Reads tuples from stdin and inserts into Reln
-// Usage:  ./insert  [-v]  RelName
+// Usage:  ./insert  [-v]  [-d]  [-b N | -j N | -p]  RelName
+// -d uses direct I/O on the data and overflow files; the page size
+//    must be a multiple of the file system's block size (e.g.
+//    create -p 4096), or the relation is not opened
+// -b inserts tuples in batches of N (see addBatchToRelation())
+// -j inserts tuples with N threads, each reading, hashing and
+//    inserting tuples (see addToRelation() for the locking)
+// -p reads, hashes and inserts tuples in a pipeline of three
+//    threads; -v then also shows how busy each stage was
 // Last modified by John Shepherd, July 2019
 
+// clock_gettime() is not in plain C99
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <time.h>
 #include "defs.h"
 #include "reln.h"
 #include "tuple.h"
+#include "ring.h"
+
+#define USAGE "./insert  [-v]  [-d]  [-b N | -j N | -p]  RelName"
+#define MAXTHREADS 64
+
+// what each -j thread needs
+typedef struct Worker {
+	pthread_t id;
+	Reln r;
+	int verbose;
+} Worker;
+
+// read and insert tuples until stdin runs out
+// each readTuple() takes a whole line, so threads share stdin
+
+static void *insertWorker(void *arg)
+{
+	Worker *w = arg;
+	Tuple t;
+	char err[2*MAXERRMSG];
+	char tup[MAXTUPLEN];
+	while ((t = readTuple(w->r,stdin)) != NULL) {
+		PageID pid = addToRelation(w->r,t);
+		tupleString(t,tup);
+		if (pid == NO_PAGE) {
+			sprintf(err, "Insert of %s failed\n", tup);
+			fatal(err);
+		}
+		if (w->verbose) printf("%s -> %lu\n",tup,pid);
+		free(t);
+	}
+	return NULL;
+}
+
+// The -p pipeline has three stages, joined by bounded queues
+// - parse: reads stdin PIPEBLOCK bytes at a time, and makes a
+//   tuple from each line
+// - hash: works out each tuple's hash from the choice vector
+// - insert (the main thread): puts each tuple in its bucket
+// A stage waits when its input queue is empty or its output queue
+//  is full, so a slow stage holds back the ones before it rather
+//  than letting tuples pile up; the pipeline runs at the speed of
+//  its slowest stage
+
+#define PIPEBLOCK (1 << 16)  // #bytes read from stdin at a time
+#define PIPEQUEUE 4096       // #tuples each queue holds
+
+// a tuple passed between stages
+typedef struct Hashed {
+	Tuple t;
+	Bits  h;  // its hash (once the hash stage has it)
+} Hashed;
+
+// one stage of the pipeline
+typedef struct Stage {
+	pthread_t id;
+	char  *name;
+	Reln   r;
+	Ring   in, out;  // NULL for the first's input and last's output
+	Total  ntuples;  // #tuples through this stage
+	Count  inwaits, outwaits; // #times it found in empty / out full
+	double waiting;  // seconds spent waiting
+	double elapsed;  // seconds from start until it finished
+} Stage;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void stagePush(Stage *s, Hashed *x)
+{
+	if (ringPut(s->out, x)) return;
+	double t = now();
+	ringPush(s->out, x, &s->outwaits);
+	s->waiting += now() - t;
+}
+
+static Bool stagePop(Stage *s, Hashed *x)
+{
+	if (ringGet(s->in, x)) return TRUE;
+	double t = now();
+	Bool ok = ringPop(s->in, x, &s->inwaits);
+	s->waiting += now() - t;
+	return ok;
+}
+
+// parse stage: pass on a tuple for each line of stdin
+// like readTuple(), stops at the first line that isn't a tuple
+
+static void *parseStage(void *arg)
+{
+	Stage *s = arg;
+	double start = now();
+	Count cap = 2*PIPEBLOCK, have = 0;
+	char *buf = malloc(cap+1);
+	assert(buf != NULL);
+	Bool eof = FALSE, stop = FALSE;
+	while (!stop && !eof) {
+		size_t n = fread(buf+have, 1, cap-have, stdin);
+		if (n == 0) {
+			// last line may have no newline
+			eof = TRUE;
+			if (have == 0) break;
+			buf[have++] = '\n';
+		}
+		have += n;
+		char *line = buf, *end = buf+have, *nl;
+		while (!stop && (nl = memchr(line, '\n', end-line)) != NULL) {
+			*nl = '\0';
+			Hashed x = { NULL, 0 };
+			if (nl - line < MAXTUPLEN-1) x.t = parseTuple(s->r, line);
+			if (x.t == NULL)
+				stop = TRUE;
+			else {
+				stagePush(s, &x);
+				s->ntuples++;
+			}
+			line = nl+1;
+		}
+		have = end - line;
+		if (have == cap) stop = TRUE;  // no newline in sight
+		memmove(buf, line, have);
+	}
+	free(buf);
+	ringClose(s->out);
+	s->elapsed = now() - start;
+	return NULL;
+}
+
+// hash stage
+
+static void *hashStage(void *arg)
+{
+	Stage *s = arg;
+	double start = now();
+	Hashed x;
+	while (stagePop(s, &x)) {
+		x.h = tupleHash(s->r, x.t);
+		stagePush(s, &x);
+		s->ntuples++;
+	}
+	ringClose(s->out);
+	s->elapsed = now() - start;
+	return NULL;
+}
+
+// insert stage, run by the caller
+
+static void insertStage(Stage *s, int verbose)
+{
+	double start = now();
+	char err[2*MAXERRMSG];
+	char tup[MAXTUPLEN];
+	Hashed x;
+	while (stagePop(s, &x)) {
+		PageID pid = addHashedToRelation(s->r, x.t, x.h);
+		tupleString(x.t,tup);
+		if (pid == NO_PAGE) {
+			sprintf(err, "Insert of %s failed\n", tup);
+			fatal(err);
+		}
+		if (verbose) printf("%s -> %lu\n",tup,pid);
+		free(x.t);
+		s->ntuples++;
+	}
+	s->elapsed = now() - start;
+}
 
-#define USAGE "./insert  [-v]  RelName"
+static void runPipeline(Reln r, int verbose)
+{
+	Ring parsed = newRing(PIPEQUEUE, sizeof(Hashed));
+	Ring hashed = newRing(PIPEQUEUE, sizeof(Hashed));
+	Stage st[3] = {
+		{ .name = "parse",  .r = r, .in = NULL,   .out = parsed },
+		{ .name = "hash",   .r = r, .in = parsed, .out = hashed },
+		{ .name = "insert", .r = r, .in = hashed, .out = NULL },
+	};
+	if (pthread_create(&st[0].id, NULL, parseStage, &st[0]) != 0
+	    || pthread_create(&st[1].id, NULL, hashStage, &st[1]) != 0)
+		fatal("Can't start pipeline thread");
+	insertStage(&st[2], verbose);
+	pthread_join(st[0].id, NULL);
+	pthread_join(st[1].id, NULL);
+	freeRing(parsed);
+	freeRing(hashed);
+	if (!verbose) return;
+	int i;
+	printf("%-7s %8s %8s %8s %8s %9s %13s\n", "stage", "tuples", "secs",
+	       "waiting", "in-waits", "out-waits", "tuples/busy-s");
+	for (i = 0; i < 3; i++) {
+		Stage *s = &st[i];
+		double busy = s->elapsed - s->waiting;
+		printf("%-7s %8lu %8.3f %8.3f %8d %9d %13.0f\n", s->name, s->ntuples,
+		       s->elapsed, s->waiting, s->inwaits, s->outwaits,
+		       (busy > 0) ? s->ntuples/busy : 0.0);
+	}
+}
 
 // Main ... process args, read/insert tuples
 
@@ -20,14 +231,34 @@ int main(int argc, char **argv)
 	char tup[MAXTUPLEN];  // buffer for printable tuples
 	int verbose;  // show extra info on query progress
 	char *rname;  // name of table/file
+	char *mode;   // how to open relation
+	int batch;    // #tuples per batch (0 for no batching)
+	int nthreads; // #insert threads (0 for none)
+	int pipeline; // run as a pipeline of stages?
 
 	// process command-line args
 
-	if (argc < 2) fatal(USAGE);
-    if (strcmp(argv[1], "-v") == 0)
-		{ verbose = 1; rname = argv[2]; }
-	else
-		{ verbose = 0; rname = argv[1]; }
+	int a = 1;
+	verbose = 0; mode = "r+"; batch = 0; nthreads = 0; pipeline = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-d") == 0)
+			mode = "r+d";
+		else if (strcmp(argv[a], "-b") == 0 && a+1 < argc)
+			batch = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-j") == 0 && a+1 < argc)
+			nthreads = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-p") == 0)
+			pipeline = 1;
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (a >= argc || batch < 0 || nthreads < 0 || nthreads > MAXTHREADS
+	    || (batch > 0) + (nthreads > 0) + pipeline > 1)
+		fatal(USAGE);
+	rname = argv[a];
 
 
 	// set up relation for writing
@@ -36,14 +267,48 @@ int main(int argc, char **argv)
 		sprintf(err, "No such relation: %s", rname);
 		fatal(err);
 	}
-	if ((r = openRelation(rname,"r+")) == NULL) {
-		sprintf(err, "Can't open relation: %s",argv[1]);
+	if ((r = openRelation(rname,mode)) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
 		fatal(err);
 	}
 
-	// read stdin and insert tuples
+	// read stdin and insert tuples a batch at a time
+
+	if (batch > 0) {
+		Tuple *ts = malloc(batch*sizeof(Tuple));
+		assert(ts != NULL);
+		int n, i;
+		do {
+			for (n = 0; n < batch; n++)
+				if ((ts[n] = readTuple(r,stdin)) == NULL) break;
+			if (n > 0 && addBatchToRelation(r,ts,n) != OK)
+				fatal("Insert of batch failed");
+			if (verbose) printf("inserted batch of %d tuples\n",n);
+			for (i = 0; i < n; i++) free(ts[i]);
+		} while (n == batch);
+		free(ts);
+	}
+
+	// read stdin and insert tuples in several threads
+
+	if (nthreads > 0) {
+		Worker ws[MAXTHREADS];
+		int i;
+		for (i = 0; i < nthreads; i++) {
+			ws[i].r = r; ws[i].verbose = verbose;
+			if (pthread_create(&ws[i].id, NULL, insertWorker, &ws[i]) != 0)
+				fatal("Can't start insert thread");
+		}
+		for (i = 0; i < nthreads; i++) pthread_join(ws[i].id, NULL);
+	}
+
+	// read, hash and insert tuples in a pipeline
+
+	if (pipeline) runPipeline(r, verbose);
+
+	// read stdin and insert tuples one at a time
 
-	while ((t = readTuple(r,stdin)) != NULL) {
+	while (batch == 0 && nthreads == 0 && !pipeline && (t = readTuple(r,stdin)) != NULL) {
 		PageID pid;
 		pid = addToRelation(r,t);
 
@@ -52,7 +317,7 @@ int main(int argc, char **argv)
 			sprintf(err, "Insert of %s failed\n", tup);
 			fatal(err);
 		}
-		if (verbose) printf("%s -> %d\n",tup,pid);
+		if (verbose) printf("%s -> %lu\n",tup,pid);
 		free(t);
 	}
 
@@ -3,102 +3,479 @@
 // Reading/writing pages into buffers and manipulating contents
 // Last modified by John Shepherd, July 2019
 
+// fileno(), ftruncate(), pwrite(), O_DIRECT and mmap flags
+//  are not in plain C99
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "defs.h"
 #include "page.h"
+#include "bufpool.h"
+
+// slot directory entry for one tuple
+typedef struct Slot {
+	unsigned short off;  // offset of tuple from start of page
+	unsigned short len;  // #bytes in tuple
+	uint32_t hash;       // hash of tuple from tupleHash()
+} Slot;
+
+// slot directory entry on a wide page
+typedef struct WideSlot {
+	unsigned short off;
+	unsigned short len;
+	uint32_t hash[2];    // low and high halves of hash
+} WideSlot;
 
 // internal representation of pages
 struct PageRep {
-	Offset free;   // offset within data[] of free space
 	Offset ovflow; // Offset of overflow page (if any)
-	Count ntuples; // #tuples in this page
-	char data[1];  // start of data
+	Count ntuples; // #tuples (and #slots) in this page
+	Count size;    // #bytes in whole page, including header
+	Offset upper;  // offset of lowest tuple byte from start of page
+	char dir[];    // slot directory, one entry per tuple
 };
 
-// A Page is a chunk of memory containing PAGESIZE bytes
-// It is implemented as a struct (free, ovflow, data[1])
-// - free is the offset of the first byte of free space
+#define HDRSIZE (offsetof(struct PageRep, dir))
+#define WIDEPAGE 0x80000000  // in size, for wide pages
+#define NO_PAGE32 0xffffffff // no overflow page, on narrow pages
+
+// A Page is a chunk of memory containing size bytes
+// It is a slotted page: (ovflow, ntuples, size, upper, slots[])
 // - ovflow is the page id of the next overflow page in bucket
-// - data[] is a sequence of bytes containing tuples
-// - each tuple is a sequence of chars terminated by '\0'
+// - size is the page size of the relation (see newRelation)
+// - slots[] grows up from the header; slot i gives offset, length
+//   and hash of tuple i, so tuples can be reached without scanning
+// - tuples are packed down from the end of the page; upper is the
+//   offset of the most recently added one
+// - each tuple is in the binary form from makeTuple(), starting
+//   on an even offset (see tuple.c)
+// - free space lies between the end of slots[] and upper
+// - offsets are 16-bit, so the largest page (64K) can't use its
+//   final byte; tuple space starts one byte short of 65536
 // - PageID values count # pages from start of file
+// Relations with 64-bit addresses (see reln.c) have wide pages:
+// - the high half of ovflow follows the header, and slots hold
+//   all 64 bits of the hash
+// - WIDEPAGE is set in size, so functions on a page can tell
+// Other pages only have room for 32-bit page ids and hashes
+
+// Each open file is registered here with its page size and #pages
+// Pages are only ever read and written at their own offsets, with
+//  pread()/pwrite() (here and in bufpool.c), never through stdio
+// An unmapped file can use direct I/O, so pages are not also held
+//  in the kernel's page cache; this needs pages that are a multiple
+//  of the file system's block size
+// Files can also be memory-mapped, in which case a Page is
+//  a pointer straight into the mapping and no copy is made
+// - the mapping lives in an address range of MAPRESERVE bytes
+//   reserved at mapFile() time, so growing it never moves pages
+// - addPage() grows the file and the mapping by whole extents
+//   and tracks the logical #pages; the file is trimmed back to
+//   that length in closePageFile()
+
+#define MAPRESERVE ((size_t)1 << 36)
+#define MAPEXTENT  256
+#define MAXFILES   16
+
+typedef struct PageFile {
+	FILE  *file;     // open file (NULL if slot unused)
+	Count  size;     // page size for this file
+	Bool   wide;     // pages have 64-bit page ids and hashes?
+	char  *base;     // start of mapping (NULL if not mapped)
+	PageID npages;   // #pages in use
+	PageID mapped;   // mapped: #pages in file and mapping
+	Bool   writable; // mapped for writing?
+	Bool   direct;   // using direct I/O?
+} PageFile;
+
+static PageFile files[MAXFILES];
+static Count nmaps = 0;
+
+static PageFile *fileOf(FILE *f)
+{
+	// one per thread, so threads using different files don't race
+	static __thread PageFile *last = NULL;
+	if (last != NULL && last->file == f) return last;
+	Count i;
+	for (i = 0; i < MAXFILES; i++)
+		if (files[i].file == f) return (last = &files[i]);
+	fatal("Page file not registered");
+	return NULL;
+}
+
+static Bool inMapping(void *p)
+{
+	Count i;
+	char *c = p;
+	if (nmaps == 0) return FALSE;
+	for (i = 0; i < MAXFILES; i++) {
+		if (files[i].base == NULL) continue;
+		if (c >= files[i].base && c < files[i].base + MAPRESERVE)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// start page-level access to an open file
+void openPageFile(FILE *f, Count size, Bool wide)
+{
+	Count i;
+	assert(size >= MINPAGESIZE && size <= MAXPAGESIZE);
+	for (i = 0; i < MAXFILES; i++)
+		if (files[i].file == NULL) break;
+	if (i == MAXFILES) fatal("Too many open page files");
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0) fatal("Can't stat page file");
+	memset(&files[i], 0, sizeof(PageFile));
+	files[i].file = f;
+	files[i].size = size;
+	files[i].wide = wide;
+	files[i].npages = st.st_size/size;
+}
+
+// page size of an open file
+Count pageSize(FILE *f)
+{
+	return fileOf(f)->size;
+}
+
+// #pages in an open file
+PageID filePages(FILE *f)
+{
+	return fileOf(f)->npages;
+}
+
+// map (f,0,mapped pages) at the start of the reserved range
+static Status remap(PageFile *m)
+{
+	int prot = m->writable ? PROT_READ|PROT_WRITE : PROT_READ;
+	if (m->mapped == 0) return OK;
+	void *p = mmap(m->base, (size_t)m->mapped*m->size, prot,
+	               MAP_SHARED|MAP_FIXED, fileno(m->file), 0);
+	return (p == MAP_FAILED) ? ~OK : OK;
+}
+
+// switch a file to memory-mapped access
+// returns ~OK if the file can't be mapped (caller
+//  can carry on using buffered access instead)
+Status mapFile(FILE *f, Bool writable)
+{
+	PageFile *m = fileOf(f);
+	assert(m->base == NULL && !m->direct);
+	bufDrop(f);
+	char *base = mmap(NULL, MAPRESERVE, PROT_NONE,
+	                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return ~OK;
+	m->base = base;
+	m->mapped = m->npages;
+	m->writable = writable;
+	if (remap(m) != OK) {
+		munmap(m->base, MAPRESERVE);
+		m->base = NULL;
+		return ~OK;
+	}
+	nmaps++;
+	return OK;
+}
+
+// cut an unmapped file back to its first npages pages
+void truncatePageFile(FILE *f, PageID npages)
+{
+	PageFile *m = fileOf(f);
+	assert(m->base == NULL);
+	bufDrop(f);
+	int ok = ftruncate(fileno(f), (off_t)npages*m->size);
+	assert(ok == 0);
+	m->npages = npages;
+}
+
+// smallest page size that direct I/O on f can use: pages must
+//  be whole blocks of its file system (0 if that isn't known)
+Count directPageSize(FILE *f)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0) return 0;
+	return st.st_blksize;
+}
+
+// switch an unmapped file to direct I/O
+// returns ~OK if the file can't use direct I/O: its page size
+//  isn't a multiple of directPageSize(), or its file system
+//  doesn't support O_DIRECT
+Status directFile(FILE *f)
+{
+	PageFile *m = fileOf(f);
+	assert(m->base == NULL);
+	Count bs = directPageSize(f);
+	if (bs == 0 || m->size % bs != 0)
+		return ~OK;
+	bufDrop(f);
+	int flags = fcntl(fileno(f), F_GETFL);
+	if (flags < 0 || fcntl(fileno(f), F_SETFL, flags|O_DIRECT) < 0)
+		return ~OK;
+	m->direct = TRUE;
+	return OK;
+}
+
+// finish page-level access to a file
+// writes back buffered pages, or trims a mapped file
+void closePageFile(FILE *f)
+{
+	PageFile *m = fileOf(f);
+	if (m->base != NULL) {
+		if (m->writable) {
+			msync(m->base, (size_t)m->mapped*m->size, MS_SYNC);
+			int ok = ftruncate(fileno(f), (off_t)m->npages*m->size);
+			assert(ok == 0);
+		}
+		munmap(m->base, MAPRESERVE);
+		nmaps--;
+	}
+	bufDrop(f);
+	m->file = NULL;
+	m->base = NULL;
+}
+
+#define isWide(p) (((p)->size & WIDEPAGE) != 0)
+#define pageBytes(p) ((p)->size & ~WIDEPAGE)
+
+// start of the slot directory
+static char *slots(Page p)
+{
+	return (char *)p + HDRSIZE + (isWide(p) ? sizeof(Offset) : 0);
+}
+
+static Count slotSize(Page p)
+{
+	return isWide(p) ? sizeof(WideSlot) : sizeof(Slot);
+}
+
+// slot i; wide and narrow slots start the same way
+static Slot *slotOf(Page p, Count i)
+{
+	return (Slot *)(slots(p) + i*slotSize(p));
+}
+
+// make size bytes at p into an empty page
+static void initPage(Page p, Count size, Bool wide)
+{
+	memset(p, 0, size);
+	p->ntuples = 0;
+	p->size = wide ? size|WIDEPAGE : size;
+	p->upper = (size > 0xffff) ? 0xffff : size;
+	pageSetOvflow(p, NO_PAGE);
+}
 
 // create a new initially empty page in memory
-Page newPage()
+Page newPage(Count size, Bool wide)
 {
-	Page p = malloc(PAGESIZE);
+	Page p = malloc(size);
 	assert(p != NULL);
-	p->free = 0;
-	p->ovflow = NO_PAGE;
-	p->ntuples = 0;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	int dataSize = PAGESIZE - hdr_size;
-	memset(p->data, 0, dataSize);
+	initPage(p, size, wide);
 	return p;
 }
 
 // append a new Page to a file; return its PageID
 PageID addPage(FILE *f)
 {
-	int ok = fseek(f, 0, SEEK_END);
-	assert(ok == 0);
-	int pos = ftell(f);
-	assert(pos >= 0);
-	PageID pid = pos/PAGESIZE;
-	Page p = newPage();
-	ok = putPage(f, pid, p);
-	assert(ok == 0);
-	return pid;
+	PageFile *m = fileOf(f);
+	return appendPage(f, newPage(m->size, m->wide));
 }
 
-// fetch a Page from a file; allocate a memory buffer
+// append Page p (from newPage()) to a file and free it
+// the page is written straight to the file, not via the pool,
+//  so the file always holds every page the pool may read back
+// return its PageID
+PageID appendPage(FILE *f, Page p)
+{
+	PageFile *m = fileOf(f);
+	assert(pageBytes(p) == m->size && isWide(p) == m->wide);
+	if (m->base != NULL) {
+		assert(m->writable);
+		if (m->npages == m->mapped) {
+			// grow by at least an extent, and at least double
+			PageID extent = (m->mapped > MAPEXTENT) ? m->mapped : MAPEXTENT;
+			m->mapped += extent;
+			int ok = ftruncate(fileno(f), (off_t)m->mapped*m->size);
+			assert(ok == 0);
+			ok = remap(m);
+			assert(ok == OK);
+		}
+		memcpy(m->base + (size_t)m->npages*m->size, p, m->size);
+		free(p);
+		return m->npages++;
+	}
+	// direct I/O needs an aligned buffer
+	static char *aligned = NULL;
+	void *buf;
+	if (aligned == NULL) {
+		if (posix_memalign(&buf, MAXPAGESIZE, MAXPAGESIZE) != 0)
+			fatal("Can't allocate page");
+		aligned = buf;
+	}
+	memcpy(aligned, p, m->size);
+	free(p);
+	ssize_t n = pwrite(fileno(f), aligned, m->size, (off_t)m->npages*m->size);
+	if (n != m->size) fatal("Can't add page");
+	return m->npages++;
+}
+
+// fetch a Page from a file via the buffer pool
+// the Page stays pinned until putPage() or releasePage()
 Page getPage(FILE *f, PageID pid)
 {
-	assert(pid >= 0);
-	Page p = malloc(PAGESIZE);
-	assert(p != NULL);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
-	assert(ok == 0);
-	int n = fread(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
-	return p;
+	assert(pid != NO_PAGE);
+	PageFile *m = fileOf(f);
+	if (m->base != NULL) {
+		assert(pid < m->npages);
+		return (Page)(m->base + (size_t)pid*m->size);
+	}
+	return bufGet(f, pid, m->size, TRUE);
+}
+
+// hint that pages first..first+n-1 of f will be wanted soon
+// starts reading them into the pool, or asks the kernel to
+//  read mapped pages ahead
+static void prefetchRun(PageFile *m, PageID first, Count n)
+{
+	if (first >= m->npages) return;
+	if (first + n > m->npages) n = m->npages - first;
+	if (m->base == NULL) {
+		bufPrefetch(m->file, first, n, m->size);
+		return;
+	}
+	// madvise() wants whole VM pages
+	size_t vmpage = sysconf(_SC_PAGESIZE);
+	char *start = m->base + (size_t)first*m->size;
+	char *end = start + (size_t)n*m->size;
+	start = m->base + ((start - m->base) & ~(vmpage-1));
+	madvise(start, end - start, MADV_WILLNEED);
+}
+
+// hint that page pid of f will be wanted soon
+void prefetchPage(FILE *f, PageID pid)
+{
+	if (pid != NO_PAGE) prefetchRun(fileOf(f), pid, 1);
+}
+
+// hint that pages pids[0..n-1] of f will be wanted soon
+// pids must be in ascending order; runs of adjacent pages
+//  are read together
+void prefetchPages(FILE *f, PageID *pids, Count n)
+{
+	PageFile *m = fileOf(f);
+	Count i, start = 0;
+	for (i = 1; i <= n; i++) {
+		if (i < n && pids[i] == pids[i-1]+1) continue;
+		prefetchRun(m, pids[start], pids[i-1] - pids[start] + 1);
+		start = i;
+	}
 }
 
-// write a Page to a file; release allocated buffer
+// write a Page to a file; release the buffer
+// pool pages are just marked dirty and written back later;
+// mapped pages have already been changed in place;
+// a Page from newPage() is copied into the pool/mapping and freed
 Status putPage(FILE *f, PageID pid, Page p)
 {
-	assert(pid >= 0);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
-	assert(ok == 0);
-	int n = fwrite(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
+	assert(pid != NO_PAGE);
+	PageFile *m = fileOf(f);
+	assert(pageBytes(p) == m->size && isWide(p) == m->wide);
+	if (m->base != NULL) {
+		char *dest = m->base + (size_t)pid*m->size;
+		assert(m->writable && pid < m->npages);
+		if ((char *)p != dest) {
+			memcpy(dest, p, m->size);
+			free(p);
+		}
+		return OK;
+	}
+	if (bufIsFrame(p)) {
+		assert(bufFile(p) == f && bufPageID(p) == pid);
+		bufRelease(p, TRUE);
+		return OK;
+	}
+	Page buf = bufGet(f, pid, m->size, FALSE);
+	memcpy(buf, p, m->size);
+	bufRelease(buf, TRUE);
 	free(p);
-	return 0;
+	return OK;
+}
+
+// finished with a Page without changing it; release the buffer
+void releasePage(Page p)
+{
+	if (inMapping(p))
+		return;
+	else if (bufIsFrame(p))
+		bufRelease(p, FALSE);
+	else
+		free(p);
 }
 
-// insert a tuple into a page
+// insert a tuple into a page, remembering its hash
 // returns 0 status if successful
 // returns -1 if not enough room
-Status addToPage(Page p, Tuple t)
+Status addToPage(Page p, Tuple t, Bits hash)
 {
-	int n = tupLength(t);
-	char *c = p->data + p->free;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
+	Count n = tupLength(t);
+	Count pad = (p->upper - n) & 1;
 	// doesn't fit ... return fail code
 	// assume caller will put it elsewhere
-	if (c+n > &p->data[PAGESIZE-hdr_size-2]) return -1;
-	strcpy(c, t);
-	p->free += n+1;
+	if (n + pad + slotSize(p) > pageFreeSpace(p)) return -1;
+	p->upper -= n + pad;
+	memcpy((char *)p + p->upper, t, n);
+	Slot *s = slotOf(p, p->ntuples);
+	s->off = p->upper;
+	s->len = n;
+	if (isWide(p)) {
+		WideSlot *w = (WideSlot *)s;
+		w->hash[0] = hash; w->hash[1] = hash >> 32;
+	}
+	else
+		s->hash = hash;
 	p->ntuples++;
 	return OK;
 }
 
 // extract page info
-char *pageData(Page p) { return p->data; }
 Count pageNTuples(Page p) { return p->ntuples; }
-Offset pageOvflow(Page p) { return p->ovflow; }
-void pageSetOvflow(Page p, PageID pid) { p->ovflow = pid; }
+PageID pageOvflow(Page p) {
+	Offset hi;
+	if (!isWide(p)) return (p->ovflow == NO_PAGE32) ? NO_PAGE : p->ovflow;
+	memcpy(&hi, p->dir, sizeof(Offset));
+	return (PageID)hi << 32 | p->ovflow;
+}
+void pageSetOvflow(Page p, PageID pid) {
+	Offset hi = pid >> 32;
+	p->ovflow = pid;
+	if (isWide(p))
+		memcpy(p->dir, &hi, sizeof(Offset));
+	else
+		assert(pid == NO_PAGE || pid < NO_PAGE32);
+}
 Count pageFreeSpace(Page p) {
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	return (PAGESIZE-hdr_size-p->free);
+	return (p->upper - (slots(p) - (char *)p) - p->ntuples*slotSize(p));
 }
 
+// extract info on i'th tuple in page
+Tuple pageTuple(Page p, Count i) {
+	assert(i < p->ntuples);
+	return (char *)p + slotOf(p, i)->off;
+}
+Count pageTupleLength(Page p, Count i) {
+	assert(i < p->ntuples);
+	return slotOf(p, i)->len;
+}
+Bits pageTupleHash(Page p, Count i) {
+	assert(i < p->ntuples);
+	if (isWide(p)) {
+		WideSlot *w = (WideSlot *)slotOf(p, i);
+		return (Bits)w->hash[1] << 32 | w->hash[0];
+	}
+	return slotOf(p, i)->hash;
+}
@@ -10,16 +10,31 @@ typedef struct PageRep *Page;
 
 #include "defs.h"
 #include "tuple.h"
+#include "bits.h"
 
-Page newPage();
+void openPageFile(FILE *, Count, Bool);
+Status mapFile(FILE *, Bool);
+void truncatePageFile(FILE *, PageID);
+Count directPageSize(FILE *);
+Status directFile(FILE *);
+void closePageFile(FILE *);
+Count pageSize(FILE *);
+PageID filePages(FILE *);
+Page newPage(Count, Bool);
 PageID addPage(FILE *);
+PageID appendPage(FILE *, Page);
 Page getPage(FILE *, PageID);
+void prefetchPage(FILE *, PageID);
+void prefetchPages(FILE *, PageID *, Count);
 Status putPage(FILE *, PageID, Page);
-Status addToPage(Page, Tuple);
-char *pageData(Page);
+void releasePage(Page);
+Status addToPage(Page, Tuple, Bits);
 Count pageNTuples(Page);
-Offset pageOvflow(Page);
+PageID pageOvflow(Page);
 void pageSetOvflow(Page, PageID);
 Count pageFreeSpace(Page);
+Tuple pageTuple(Page, Count);
+Count pageTupleLength(Page, Count);
+Bits pageTupleHash(Page, Count);
 
 #endif
@@ -13,14 +13,30 @@
 // A suggestion ... you can change however you like
 #define INT_SIZE sizeof(int) * 8
 
+// #candidate buckets in each window of the scan (see planWindow)
+#define PREFETCH 8
+// most overflow pages read ahead for one window
+#define MAXPLAN  (8*PREFETCH)
+
 struct QueryRep {
 	Reln    rel;       // need to remember Relation info
 	PageID  curpage;   // current page in scan
-	int     is_ovflow; // are we in the overflow pages?
-	Offset  curtup;    // offset of current tuple within page
-	char 	*querystring;
-	int     *pages;
+	PageID  is_ovflow; // overflow page we are in (NO_PAGE if none)
+	Offset  curtup;    // slot of next tuple to check within page
+	Tuple   query;     // query in tuple form, '?' for unknowns
+	Bits    knownmask; // hash bits fixed by known attributes
+	Bits    knownbits; // values of those bits
+	PageID  *pages;    // candidate buckets, in file order
 	int     page_num;
+	int     planned;   // #candidate buckets planned so far
+	char    known[MAXBITS];   // value of each known hash bit
+	char    unknown[MAXBITS]; // is each hash bit unknown?
+	// only while another process writes (see getNextShared)
+	Tuple   *found;    // matching tuples of the current bucket
+	int     nfound, nextfound, maxfound;
+	PageID  *done;     // buckets whose tuples have been handed out
+	Count   *donebits; // #hash bits that addressed each of them
+	int     ndone;
 	//TODO
 };
 
@@ -58,42 +74,56 @@ int reverseBits(int n)
     return reverse;
 }
 
-Query startQuery(Reln r, char *q)
+static int cmpPageID(const void *a, const void *b)
 {
-	Query new = malloc(sizeof(struct QueryRep));
-	assert(new != NULL);
-	Count nvals = nattrs(r);
-	Bits hashval[nvals];
-	ChVecItem *choiceVector = chvec(r);
-	char **vals = malloc(nvals*sizeof(char *));
-	tupleVals(q,vals);
-	char* known = calloc(MAXBITS, sizeof(char));
-	char* unknown = calloc(MAXBITS, sizeof(char));
-	
-	int* pages2 = calloc(npages(r), sizeof(int));
-	for (int i = 0; i < MAXBITS; i++) {
-		int att_value = choiceVector[i].att;
-		if (strcmp(vals[att_value], "?") == 0) {
-			unknown[i] = 1;
-		} else {
-			hashval[att_value] = hash_any((unsigned char *)vals[att_value],strlen(vals[att_value]));
-			known[i] = bitIsSet(hashval[att_value], choiceVector[i].bit);
-		}
+	PageID x = *(PageID *)a, y = *(PageID *)b;
+	return (x > y) - (x < y);
+}
+
+// #hash bits that address bucket b of r as it is now
+
+static Count bucketBits(Reln r, PageID b)
+{
+	return (b < splitp(r) || b >= ((PageID)1 << depth(r))) ? depth(r)+1 : depth(r);
+}
+
+// were the tuples of bucket b (addressed by nbits hash bits)
+//  handed out already, as part of some bucket before it split?
+
+static int covered(Query q, PageID b, Count nbits)
+{
+	for (int i = 0; i < q->ndone; i++) {
+		if (q->donebits[i] > nbits) continue;
+		if (q->donebits[i] == 0 || getLower(b, q->donebits[i]) == q->done[i])
+			return 1;
 	}
-	
+	return 0;
+}
+
+// work out the candidate buckets for q, from the relation's
+//  current depth and split pointer
+
+static void planBuckets(Query q)
+{
+	Reln r = q->rel;
+	char *known = q->known, *unknown = q->unknown;
+	PageID* pages2 = calloc(npages(r), sizeof(PageID));
+	assert(pages2 != NULL);
 	int bit = 1;
 	int page_record = 1;
 	pages2[0] = 0;
 	
 	for (int j = 0;j <= depth(r);j++) {
 		if (j == depth(r)) {
-			for (int i = 0; i < page_record; i++) {
+			// buckets before sp have been split; use one more bit
+			int nbuckets = page_record;
+			for (int i = 0; i < nbuckets; i++) {
 				if (pages2[i] < splitp(r)) {
 					if (known[depth(r)] == 1) {
-						pages2[i] = pages2[i] | (1 << depth(r));
+						pages2[i] = pages2[i] | ((PageID)1 << depth(r));
 					}
 					if (unknown[depth(r)] == 1) {
-						pages2[page_record+1] = pages2[i] | (1 << depth(r));
+						pages2[page_record] = pages2[i] | ((PageID)1 << depth(r));
 						page_record++;
 					}
 				}
@@ -118,13 +148,79 @@ Query startQuery(Reln r, char *q)
 		}
 	}
 	
+	// while a split is under way, some of the new bucket's tuples
+	//  are still in the old one (see reln.c); shared scans look
+	//  there themselves (see scanBucket)
+	if (splitNew(r) != NO_PAGE && !sharedRelation(r)) {
+		int hasold = 0, hasnew = 0;
+		for (int i = 0; i < page_record; i++) {
+			if (pages2[i] == splitOld(r)) hasold = 1;
+			if (pages2[i] == splitNew(r)) hasnew = 1;
+		}
+		if (hasnew && !hasold) pages2[page_record++] = splitOld(r);
+	}
+	// after the relation has changed, skip what's been handed out
+	if (q->ndone > 0) {
+		int n = 0;
+		for (int i = 0; i < page_record; i++)
+			if (!covered(q, pages2[i], bucketBits(r, pages2[i])))
+				pages2[n++] = pages2[i];
+		page_record = n;
+	}
+	// visit buckets in file order, so reads can be merged
+	qsort(pages2, page_record, sizeof(PageID), cmpPageID);
+	q->pages = pages2;
+	q->page_num = page_record;
+}
+
+Query startQuery(Reln r, char *q)
+{
+	Count nvals = nattrs(r);
+	Tuple qt = makeTuple(q);
+	if (qt == NULL) return NULL;
+	if (tupleNAttrs(qt) != nvals) {
+		free(qt);
+		return NULL;
+	}
+	Query new = malloc(sizeof(struct QueryRep));
+	assert(new != NULL);
+	Bits hashval[nvals];
+	HashFn hf = hashFunction(hashId(r));
+	HashPlan *plan = hashPlan(r);
+	char *known = new->known, *unknown = new->unknown;
+	memset(known, 0, MAXBITS);
+	memset(unknown, 0, MAXBITS);
+	// unknown attributes contribute no bits
+	Bits knownmask = 0;
+	for (int k = 0; k < plan->natts; k++) {
+		Count a = plan->atts[k];
+		char *val = tupleAttr(qt, a);
+		if (strcmp(val, "?") == 0)
+			hashval[a] = 0;
+		else {
+			hashval[a] = hf((unsigned char *)val,tupleAttrLength(qt, a));
+			knownmask |= plan->to[k];
+		}
+	}
+	Bits knownbits = gatherBits(plan, hashval) & knownmask;
+	for (int i = 0; i < addrBits(r); i++) {
+		unknown[i] = ((knownmask >> i) & 1) == 0;
+		known[i] = (knownbits >> i) & 1;
+	}
 	new -> rel = r;
-	new -> is_ovflow = -1;
+	new -> is_ovflow = NO_PAGE;
 	new -> curpage = 0;
 	new -> curtup = 0;
-	new -> querystring = q;
-	new -> pages = pages2;
-	new -> page_num = page_record;
+	new -> query = qt;
+	new -> knownmask = knownmask;
+	new -> knownbits = knownbits;
+	new -> planned = 0;
+	new -> found = NULL;
+	new -> nfound = new -> nextfound = new -> maxfound = 0;
+	new -> done = NULL;
+	new -> donebits = NULL;
+	new -> ndone = 0;
+	planBuckets(new);
 	// TODO
 	// Partial algorithm:
 	// form known bits from known attributes
@@ -135,10 +231,142 @@ Query startQuery(Reln r, char *q)
 	return new;
 }
 
+// Candidate buckets are scanned PREFETCH at a time, in file order
+// Before a window of buckets is scanned:
+// - the primary pages of the next window are read ahead
+// - the overflow chains of this window are read ahead a level at a
+//   time: all first overflow pages, then all second ones, and so on;
+//   each level is sorted, so that adjacent pages are read together
+// The primary pages of the first window are read ahead here too;
+//  later ones were read ahead with the window before them
+
+static void planWindow(Query q)
+{
+	FILE *data = dataFile(q->rel), *ovflow = ovflowFile(q->rel);
+	int from = q->planned, i;
+	int to = (from + PREFETCH < q->page_num) ? from + PREFETCH : q->page_num;
+	int next = (to + PREFETCH < q->page_num) ? to + PREFETCH : q->page_num;
+	if (from == 0) prefetchPages(data, q->pages, to);
+	prefetchPages(data, q->pages + to, next - to);
+
+	PageID level[PREFETCH];
+	Count n = 0, nplanned = 0, k;
+	for (i = from; i < to; i++) {
+		Page p = getPage(data, q->pages[i]);
+		if (pageOvflow(p) != NO_PAGE) level[n++] = pageOvflow(p);
+		releasePage(p);
+	}
+	while (n > 0 && nplanned < MAXPLAN) {
+		qsort(level, n, sizeof(PageID), cmpPageID);
+		prefetchPages(ovflow, level, n);
+		nplanned += n;
+		// successors replace pages in level as they're read
+		Count m = 0;
+		for (k = 0; k < n; k++) {
+			Page p = getPage(ovflow, level[k]);
+			if (pageOvflow(p) != NO_PAGE) level[m++] = pageOvflow(p);
+			releasePage(p);
+		}
+		n = m;
+	}
+	q->planned = to;
+}
+
+// While another process inserts, a bucket's pages may change (or
+//  be half-written) as they are read, and splits move tuples to
+//  buckets the query didn't plan for (see reln.c)
+// So each candidate bucket is read whole, and its matching tuples
+//  are handed out only if the relation's version didn't change
+//  while its pages were read
+// If it did, the relation is read again, and the candidates are
+//  worked out afresh, leaving out buckets that came from splitting
+//  ones already handed out
+// Each tuple is taken only from the bucket it now belongs in, so
+//  a split under way can't make it appear twice
+
+static void addFound(Query q, Tuple t)
+{
+	if (q->nfound == q->maxfound) {
+		q->maxfound = (q->maxfound == 0) ? 64 : 2*q->maxfound;
+		q->found = realloc(q->found, q->maxfound*sizeof(Tuple));
+		assert(q->found != NULL);
+	}
+	q->found[q->nfound++] = t;
+}
+
+static void markDone(Query q, PageID b)
+{
+	if ((q->ndone & (q->ndone-1)) == 0) {
+		int max = (q->ndone == 0) ? 1 : 2*q->ndone;
+		q->done = realloc(q->done, max*sizeof(PageID));
+		q->donebits = realloc(q->donebits, max*sizeof(Count));
+		assert(q->done != NULL && q->donebits != NULL);
+	}
+	q->done[q->ndone] = b;
+	q->donebits[q->ndone++] = bucketBits(q->rel, b);
+}
+
+// add the matching tuples of bucket b in the chain starting at
+//  data page first to q->found
+// returns 0 if the relation changed while the chain was read
+
+static int scanChain(Query q, PageID b, PageID first)
+{
+	Reln r = q->rel;
+	FILE *f = dataFile(r);
+	PageID pid = first;
+	while (pid != NO_PAGE) {
+		Page p = getPage(f, pid);
+		// don't trust the page (even its links) if it may be torn
+		if (relationChanged(r)) {
+			releasePage(p);
+			return 0;
+		}
+		for (Count slot = 0; slot < pageNTuples(p); slot++) {
+			Bits h = pageTupleHash(p, slot);
+			if ((h & q->knownmask) != q->knownbits || bucketOf(r, h) != b)
+				continue;
+			Tuple t = pageTuple(p, slot);
+			if (tupleMatch(r,t,q->query) == TRUE) addFound(q, copyTuple(t));
+		}
+		pid = pageOvflow(p);
+		releasePage(p);
+		f = ovflowFile(r);
+	}
+	return 1;
+}
+
+static Tuple getNextShared(Query q)
+{
+	Reln r = q->rel;
+	for (;;) {
+		if (q->nextfound < q->nfound) return q->found[q->nextfound++];
+		q->nfound = q->nextfound = 0;
+		if (q->curpage >= q->page_num) return NULL;
+		PageID b = q->pages[q->curpage];
+		int ok = scanChain(q, b, b);
+		if (ok && b == splitNew(r)) ok = scanChain(q, b, splitOld(r));
+		if (ok) {
+			markDone(q, b);
+			q->curpage++;
+			continue;
+		}
+		// start again from the relation as it is now
+		for (int i = 0; i < q->nfound; i++) free(q->found[i]);
+		q->nfound = 0;
+		refreshRelation(r);
+		free(q->pages);
+		planBuckets(q);
+		q->curpage = 0;
+	}
+}
+
 // get next tuple during a scan
 
 Tuple getNextTuple(Query q)
 {
+	if (sharedRelation(q->rel)) return getNextShared(q);
+
 	// TODO
 	// Partial algorithm:
 	// if (more tuples in current page)
@@ -154,85 +382,75 @@ Tuple getNextTuple(Query q)
 	//    go to next page (try again)
 	// endif
 
-	int *pages = q->pages;
+	PageID *pages = q->pages;
 	
 	for (int i = q->curpage; i < q->page_num; i++) {
 
-		Page p = getPage(dataFile(q->rel),pages[i]);
-		if (q->is_ovflow == -1) {
-			
-			char *data = pageData(p);
-			
-			data = data + q->curtup;
-			int counter = q->curtup;
-			while (strlen(data) != 0) {
-				int tuple_length = strlen(data);
-				
-				if(tupleMatch(q->rel,&data[0],q->querystring) == TRUE){
-					q->curpage = i;
-					q->curtup = counter+tuple_length+1;
-					
-					char* return_data = malloc((tuple_length+1)*sizeof(char));
-					strcpy(return_data, &data[0]);
-					
-					free(p);
-					
+		q->curpage = i;
+		if (i == q->planned) planWindow(q);
+		if (q->is_ovflow == NO_PAGE) {
+			Page p = getPage(dataFile(q->rel),pages[i]);
+			Count ntups = pageNTuples(p);
+			if (q->curtup == 0)
+				prefetchPage(ovflowFile(q->rel), pageOvflow(p));
+			while (q->curtup < ntups) {
+				Count slot = q->curtup++;
+				// the hash stored with the tuple rules out most
+				//  non-matching tuples without looking at them
+				if ((pageTupleHash(p, slot) & q->knownmask) != q->knownbits)
+					continue;
+				Tuple t = pageTuple(p, slot);
+				if (tupleMatch(q->rel,t,q->query) == TRUE) {
+					Tuple return_data = copyTuple(t);
+					releasePage(p);
 					return return_data;
 				}
-				else {
-					data = data + tuple_length + 1;
-					counter += tuple_length + 1;
-				}
 			}
 			q->curtup = 0;
-			if(pageOvflow(p) == -1){
+			if(pageOvflow(p) == NO_PAGE){
 				q->curpage = i+1;
 			}
 			else{
 				q->is_ovflow = pageOvflow(p);
 			}
-			free(p);
+			releasePage(p);
 		}
-		if(q->is_ovflow != -1) {
-			while(q->is_ovflow != -1){
-				
-				Page p = getPage(ovflowFile(q->rel), q->is_ovflow);
-				char *data = pageData(p);
-				data = data + q->curtup;
-				int counter = q->curtup;
-				while (strlen(data) != 0) {
-					int tuple_length = strlen(data);
-					
-					if(tupleMatch(q->rel,&data[0],q->querystring) == TRUE) {
-						q->curtup = counter+tuple_length+1;
-						
-						char* return_data = malloc((tuple_length+1)*sizeof(char));
-						strcpy(return_data, &data[0]);
-						free(p);
-						
-						return return_data;
-					}
-					else{
-						data = data + tuple_length + 1;
-						counter += tuple_length + 1;
-					}
-					
-				}
-				q->curtup = 0;
-				if (pageOvflow(p) == -1) {
-					q->is_ovflow = -1;
-					q->curpage = i+1;
-				}else{
-					q->is_ovflow = pageOvflow(p);
+		while (q->is_ovflow != NO_PAGE) {
+			Page p = getPage(ovflowFile(q->rel), q->is_ovflow);
+			Count ntups = pageNTuples(p);
+			if (q->curtup == 0)
+				prefetchPage(ovflowFile(q->rel), pageOvflow(p));
+			while (q->curtup < ntups) {
+				Count slot = q->curtup++;
+				if ((pageTupleHash(p, slot) & q->knownmask) != q->knownbits)
+					continue;
+				Tuple t = pageTuple(p, slot);
+				if (tupleMatch(q->rel,t,q->query) == TRUE) {
+					Tuple return_data = copyTuple(t);
+					releasePage(p);
+					return return_data;
 				}
-				free(p);
 			}
-		} 
+			q->curtup = 0;
+			if (pageOvflow(p) == NO_PAGE) {
+				q->is_ovflow = NO_PAGE;
+				q->curpage = i+1;
+			}else{
+				q->is_ovflow = pageOvflow(p);
+			}
+			releasePage(p);
+		}
 	}
 	return NULL;
 }
 
 void closeQuery(Query q)
 {
+	free(q->query);
+	free(q->pages);
+	for (int i = q->nextfound; i < q->nfound; i++) free(q->found[i]);
+	free(q->found);
+	free(q->done);
+	free(q->donebits);
 	free(q);
 }
@@ -2,6 +2,12 @@
 // part of Multi-attribute Linear-hashed Files
 // Last modified by John Shepherd, July 2019
 
+// pthread_rwlock_t is not in plain C99
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "defs.h"
 #include "reln.h"
 #include "page.h"
@@ -9,32 +15,340 @@
 #include "chvec.h"
 #include "bits.h"
 #include "hash.h"
+#include "wal.h"
+#include "bufpool.h"
 
 #define HEADERSIZE (3*sizeof(Count)+sizeof(Offset))
 
+// #pages of a split under way moved by each insert (see splitWork())
+#define SPLITWORK 2
+// #bucket latches; bucket p uses latch p % NLATCH
+#define NLATCH 64
+
 struct RelnRep {
 	Count  nattrs; // number of attributes
 	Count  depth;  // depth of main data file
-	Offset sp;     // split pointer
-    Count  npages; // number of main data pages
-    Count  ntups;  // total number of tuples
+	PageID sp;     // split pointer
+	PageID npages; // number of main data pages
+	Total  ntups;  // total number of tuples
 	ChVec  cv;     // choice vector
+	HashPlan plan; // attributes that cv uses (see compileChVec())
+	Count  pagesize; // bytes per page in data/ovflow files
+	Count  addrbits; // #bits in hashes and page ids on pages (32 or 64)
+	PageID freeov; // first page on overflow free list
+	Total  nfree;  // number of pages on overflow free list
+	Total  nsplits;     // number of bucket splits so far
+	Total  splitreads;  // #pages read by those splits
+	Total  splitwrites; // #pages written by those splits
+	Count  policy; // when to split (see splitDue())
+	Count  param;  // parameter for split policy
+	Total  nbytes; // #bytes in all tuples
+	PageID splitold; // bucket whose split is under way (NO_PAGE if none)
+	PageID splitnew; // bucket its tuples are moving to
+	PageID splitcur; // next page of splitold's chain to move tuples from
+	Count  splitcurov; // is splitcur in the overflow file?
+	PageID splitprev;  // page before splitcur (NO_PAGE if not known yet)
+	Bool   splitprevov; // is splitprev in the overflow file?
 	char   mode;   // open for read/write
 	FILE  *info;   // handle on info file
 	FILE  *data;   // handle on data file
 	FILE  *ovflow; // handle on ovflow file
+	Wal    wal;    // write-ahead log (NULL if not logging)
+	Count  nops;   // #operations since last group commit
+	Count  version; // #times .info has been published (see publish())
+	Offset verpos; // where the version word is in .info
+	Bool   shared; // reading while another process writes?
+	Count  hashid; // hash function for attribute values (see hash.h)
+	pthread_rwlock_t shape; // shared by inserts; exclusive to split or commit
+	pthread_mutex_t  lock;  // guards ntups, nbytes and nops
+	pthread_mutex_t  ovlock;   // guards overflow free list and file growth
+	pthread_mutex_t  splitmu;  // held while moving tuples of a split
+	pthread_mutex_t  latch[NLATCH]; // guard the pages of buckets
 };
 
+// The .info file holds a relation's global data
+// Its layout has a format number, after a magic number that
+//  relations made before formats were numbered don't have:
+// - format 1 (no magic): 32-bit fields, a 32-entry choice vector,
+//   and the hash id after the version word (see readVersion());
+//   it's only read, and is rewritten as format 2 by a writer
+// - format 2: 64-bit fields, and a full choice vector
+// Relations with 32-bit addresses (format 1 ones, and any made that
+//  way) keep their narrow pages either way (see page.c)
+
+#define INFOMAGIC  0x46484c4d  // "MLHF"
+#define INFOFORMAT 2
+
+typedef Count PageID32;  // page ids in format 1
+#define NO_PAGE32 0xffffffff
+
+// #bytes in the .info file, before the version word
+#define INFOSIZE (22*sizeof(uint64_t) + sizeof(ChVec))
+// ... and in format 1
+#define OLDINFOSIZE (5*sizeof(Count) + 32*sizeof(ChVecItem) + sizeof(Count) \
+                     + sizeof(PageID32) + sizeof(Count) + 3*sizeof(Count) \
+                     + 3*sizeof(Count) + 3*sizeof(PageID32) + sizeof(Count))
+
+// default parameter for each split policy
+// (SPLIT_EVERY's is the number of tuples that used to be
+//  assumed to fit in a page)
+
+static Count defaultParam(Count policy, Count nattrs, Count pagesize)
+{
+	switch (policy) {
+	case SPLIT_EVERY: return pagesize / (10 * nattrs);
+	case SPLIT_LOAD:  return 75;
+	default:          return 0;
+	}
+}
+
+static void put64(char **c, uint64_t v) { memcpy(*c, &v, 8); *c += 8; }
+static uint64_t get64(char **c) { uint64_t v; memcpy(&v, *c, 8); *c += 8; return v; }
+static Count get32(char **c) { Count v; memcpy(&v, *c, 4); *c += 4; return v; }
+static PageID getPage32(char **c)
+{
+	PageID32 pid = get32(c);
+	return (pid == NO_PAGE32) ? NO_PAGE : pid;
+}
+
+// build the contents of the .info file in buf
+
+static void infoImage(Reln r, char *buf)
+{
+	char *c = buf;
+	put64(&c, INFOMAGIC);
+	put64(&c, INFOFORMAT);
+	// how attributes are hashed and addressed
+	put64(&c, r->addrbits);
+	put64(&c, r->hashid);
+	// core relation info
+	put64(&c, r->nattrs);
+	put64(&c, r->npages);
+	put64(&c, r->ntups);
+	put64(&c, r->depth);
+	put64(&c, r->sp);
+	put64(&c, r->pagesize);
+	// overflow free list
+	put64(&c, r->freeov);
+	put64(&c, r->nfree);
+	// split costs
+	put64(&c, r->nsplits);
+	put64(&c, r->splitreads);
+	put64(&c, r->splitwrites);
+	// split policy
+	put64(&c, r->policy);
+	put64(&c, r->param);
+	put64(&c, r->nbytes);
+	// split under way
+	put64(&c, r->splitold);
+	put64(&c, r->splitnew);
+	put64(&c, r->splitcur);
+	put64(&c, r->splitcurov);
+	// choice vector
+	memcpy(c, r->cv, sizeof(ChVec));
+}
+
+static void writeInfo(Reln r)
+{
+	char buf[INFOSIZE];
+	infoImage(r, buf);
+	ssize_t n = pwrite(fileno(r->info), buf, INFOSIZE, 0);
+	assert(n == INFOSIZE);
+}
+
+// set r from a format 1 .info file, n bytes of which are in buf
+// fields missing from relations made by older versions get defaults
+
+static void readOldInfo(Reln r, char *buf, ssize_t n)
+{
+	char *c = buf;
+	char *end = buf + (n < 0 ? 0 : n);
+	// core relation info, choice vector, page size, free list
+	assert(end >= buf + 5*sizeof(Count) + 32*sizeof(ChVecItem)
+	               + 2*sizeof(Count) + sizeof(PageID32));
+	r->nattrs = get32(&c);
+	r->depth = get32(&c);
+	r->sp = get32(&c);
+	r->npages = get32(&c);
+	r->ntups = get32(&c);
+	memset(r->cv, 0, sizeof(ChVec));
+	memcpy(r->cv, c, 32*sizeof(ChVecItem)); c += 32*sizeof(ChVecItem);
+	r->pagesize = get32(&c);
+	r->freeov = getPage32(&c);
+	r->nfree = get32(&c);
+	r->addrbits = 32;
+	// relations made before split costs were kept don't have them
+	r->nsplits = r->splitreads = r->splitwrites = 0;
+	if (c + 3*sizeof(Count) <= end) {
+		r->nsplits = get32(&c);
+		r->splitreads = get32(&c);
+		r->splitwrites = get32(&c);
+	}
+	// nor do those made before split policies
+	r->policy = SPLIT_EVERY;
+	r->param = defaultParam(SPLIT_EVERY, r->nattrs, r->pagesize);
+	r->nbytes = 0;
+	if (c + 3*sizeof(Count) <= end) {
+		r->policy = get32(&c);
+		r->param = get32(&c);
+		r->nbytes = get32(&c);
+	}
+	// nor do those made before splits were spread over inserts
+	r->splitold = r->splitnew = r->splitcur = NO_PAGE;
+	r->splitcurov = 0;
+	if (c + 3*sizeof(PageID32) + sizeof(Count) <= end) {
+		r->splitold = getPage32(&c);
+		r->splitnew = getPage32(&c);
+		r->splitcur = getPage32(&c);
+		r->splitcurov = get32(&c);
+	}
+	// the version word follows, then the hash id; relations made
+	//  before there was a choice of hash function use lookup2
+	r->verpos = OLDINFOSIZE;
+	Count id;
+	if (pread(fileno(r->info), &id, sizeof(Count), OLDINFOSIZE+sizeof(Count))
+	    != sizeof(Count))
+		id = HASH_LOOKUP2;
+	r->hashid = id;
+}
+
+// set r from the contents of the .info file
+
+static void readInfo(Reln r)
+{
+	char buf[INFOSIZE];
+	char *c = buf;
+	ssize_t n = pread(fileno(r->info), buf, INFOSIZE, 0);
+	if (n < (ssize_t)(2*sizeof(uint64_t)) || get64(&c) != INFOMAGIC) {
+		readOldInfo(r, buf, n);
+		return;
+	}
+	if (get64(&c) != INFOFORMAT || n != INFOSIZE)
+		fatal("Relation has an unknown .info format");
+	r->addrbits = get64(&c);
+	r->hashid = get64(&c);
+	r->nattrs = get64(&c);
+	r->npages = get64(&c);
+	r->ntups = get64(&c);
+	r->depth = get64(&c);
+	r->sp = get64(&c);
+	r->pagesize = get64(&c);
+	r->freeov = get64(&c);
+	r->nfree = get64(&c);
+	r->nsplits = get64(&c);
+	r->splitreads = get64(&c);
+	r->splitwrites = get64(&c);
+	r->policy = get64(&c);
+	r->param = get64(&c);
+	r->nbytes = get64(&c);
+	r->splitold = get64(&c);
+	r->splitnew = get64(&c);
+	r->splitcur = get64(&c);
+	r->splitcurov = get64(&c);
+	memcpy(r->cv, c, sizeof(ChVec));
+	r->verpos = INFOSIZE;
+}
+
+// The version word after the .info contents lets readers in other
+//  processes see a consistent relation while a writer runs:
+// - the writer makes it odd, writes back all changed pages and the
+//   new .info contents, then makes it even again (see publish())
+// - between publications, the files don't change, apart from new
+//   pages added at their ends, which nothing links to yet
+// - a reader takes .info only when the version is even and the
+//   same before and after reading it, and checks that it hasn't
+//   changed since, as it reads pages (see query.c)
+// Relations made before versions have none; it reads as 0
+
+static Count readVersion(Reln r)
+{
+	Count v;
+	if (pread(fileno(r->info), &v, sizeof(Count), r->verpos) != sizeof(Count))
+		return 0;
+	return v;
+}
+
+static void setVersion(Reln r, Count v)
+{
+	r->version = v;
+	ssize_t n = pwrite(fileno(r->info), &v, sizeof(Count), r->verpos);
+	assert(n == sizeof(Count));
+}
+
+// where the version word is depends on the .info format
+
+static void findVersion(Reln r)
+{
+	uint64_t magic;
+	if (pread(fileno(r->info), &magic, sizeof(uint64_t), 0) == sizeof(uint64_t)
+	    && magic == INFOMAGIC)
+		r->verpos = INFOSIZE;
+	else
+		r->verpos = OLDINFOSIZE;
+}
+
+// read .info, waiting out a writer that is publishing
+
+static void loadInfo(Reln r)
+{
+	for (;;) {
+		findVersion(r);
+		Count v = readVersion(r);
+		if (!r->shared) {
+			readInfo(r);
+			r->version = v;
+			return;
+		}
+		if (v % 2 == 0) {
+			readInfo(r);
+			if (readVersion(r) == v) {
+				r->version = v;
+				return;
+			}
+		}
+		sched_yield();
+	}
+}
+
+static void initLocks(Reln r)
+{
+	Count i;
+	pthread_rwlock_init(&r->shape, NULL);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_mutex_init(&r->ovlock, NULL);
+	pthread_mutex_init(&r->splitmu, NULL);
+	for (i = 0; i < NLATCH; i++) pthread_mutex_init(&r->latch[i], NULL);
+}
+
 // create a new relation (three files)
+// pagesize must be a power of 2 in MINPAGESIZE..MAXPAGESIZE
+// param 0 gives the split policy its default parameter
+// hashid says how attribute values are hashed (see hash.h)
+// addrbits (32 or 64) is the #bits in hashes and page ids on pages;
+//  64 lets the file grow past 2^32 buckets or overflow pages
 
-Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv)
+Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv,
+                   Count pagesize, Count policy, Count param, Count hashid,
+                   Count addrbits)
 {
     char fname[MAXFILENAME];
 	Reln r = malloc(sizeof(struct RelnRep));
+	assert(r != NULL);
 	r->nattrs = nattrs; r->depth = d; r->sp = 0;
 	r->npages = npages; r->ntups = 0; r->mode = 'w';
-	assert(r != NULL);
+	r->pagesize = pagesize;
+	r->freeov = NO_PAGE; r->nfree = 0;
+	r->nsplits = r->splitreads = r->splitwrites = 0;
+	r->policy = policy; r->nbytes = 0;
+	r->splitold = r->splitnew = r->splitcur = NO_PAGE; r->splitcurov = 0;
+	r->param = (param == 0) ? defaultParam(policy, nattrs, pagesize) : param;
+	r->wal = NULL; r->nops = 0;
+	r->version = 0; r->verpos = INFOSIZE; r->shared = FALSE;
+	r->hashid = hashid; r->addrbits = addrbits;
+	initLocks(r);
+	if (hashid >= NHASHES || (addrbits != 32 && addrbits != 64)) return ~OK;
 	if (parseChVec(r, cv, r->cv) != OK) return ~OK;
+	compileChVec(r->cv, r->addrbits, &r->plan);
 	sprintf(fname,"%s.info",name);
 	r->info = fopen(fname,"w");
 	assert(r->info != NULL);
@@ -44,8 +358,11 @@ Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv)
 	sprintf(fname,"%s.ovflow",name);
 	r->ovflow = fopen(fname,"w");
 	assert(r->ovflow != NULL);
+	openPageFile(r->data, r->pagesize, addrbits == 64);
+	openPageFile(r->ovflow, r->pagesize, addrbits == 64);
 	int i;
 	for (i = 0; i < npages; i++) addPage(r->data);
+	setVersion(r, 0);
 	closeRelation(r);
 	return 0;
 }
@@ -67,12 +384,35 @@ Bool existsRelation(char *name)
 
 // set up a relation descriptor from relation name
 // open files, reads information from rel.info
+// mode is an fopen() mode, optionally followed by 'm'
+//  to memory-map the data and overflow files (e.g. "rm")
+//  or 'd' to use direct I/O on them (e.g. "r+d"); that needs
+//  a page size that is a multiple of the file system's block
+//  size, and is refused otherwise
+// changes through a writable, unmapped Reln are write-ahead logged
 
 Reln openRelation(char *name, char *mode)
 {
 	Reln r;
+	char msg[MAXERRMSG];
+	// redo committed changes from a writer that crashed; a reader
+	//  can't change the files, so it has to leave that to a writer
+	if (mode[0] == 'w' || mode[1] == '+') {
+		if (walRecover(name) != OK) fatal("Can't recover relation from log");
+	}
+	else if (walPending(name)) {
+		snprintf(msg, MAXERRMSG, "Relation %s has changes to recover"
+		         " from its log; open it for writing first"
+		         " (e.g. ./insert %s < /dev/null)", name, name);
+		fatal(msg);
+	}
 	r = malloc(sizeof(struct RelnRep));
 	assert(r != NULL);
+	char fmode[4] = "";
+	Bool mapped = (strchr(mode,'m') != NULL);
+	Bool direct = (strchr(mode,'d') != NULL);
+	strncat(fmode, mode, strcspn(mode,"md") < 3 ? strcspn(mode,"md") : 3);
+	mode = fmode;
 	char fname[MAXFILENAME];
 	sprintf(fname,"%s.info",name);
 	r->info = fopen(fname,mode);
@@ -83,412 +423,898 @@ Reln openRelation(char *name, char *mode)
 	sprintf(fname,"%s.ovflow",name);
 	r->ovflow = fopen(fname,mode);
 	assert(r->ovflow != NULL);
-	// Naughty: assumes Count and Offset are the same size
-	int n = fread(r, sizeof(Count), 5, r->info);
-	assert(n == 5);
-	n = fread(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
-	assert(n == MAXCHVEC);
 	r->mode = (mode[0] == 'w' || mode[1] =='+') ? 'w' : 'r';
+	r->wal = NULL; r->nops = 0;
+	// a reader while another process writes can't map the files,
+	//  and has to check for changes as it goes (see query.c)
+	r->shared = (r->mode == 'r' && walBusy(name));
+	if (r->shared) mapped = FALSE;
+	loadInfo(r);
+	if (r->hashid >= NHASHES) fatal("Relation uses an unknown hash function");
+	compileChVec(r->cv, r->addrbits, &r->plan);
+	r->splitprev = NO_PAGE;  // not in .info (see splitStep())
+	openPageFile(r->data, r->pagesize, r->addrbits == 64);
+	openPageFile(r->ovflow, r->pagesize, r->addrbits == 64);
+	initLocks(r);
+	// mapped pages can reach the file at any time, so can't be logged
+	// (the log is opened first, as it checks for another writer)
+	if (!mapped && r->mode == 'w') r->wal = walOpen(name);
+	// a writer that crashed may have been publishing
+	if (r->mode == 'w' && r->version % 2 == 1) setVersion(r, r->version+1);
+	// a format 1 .info is rewritten as format 2; readers see a new
+	//  version, and look for it in its new place
+	if (r->mode == 'w' && r->verpos != INFOSIZE) {
+		writeInfo(r);
+		r->verpos = INFOSIZE;
+		setVersion(r, r->version+2);
+		syncFile(r->info);
+	}
+	// drop any data pages added after the last commit
+	// (unused overflow pages added then are just wasted)
+	if (r->mode == 'w') truncatePageFile(r->data, r->npages);
+	// if mapping fails, just fall back to the buffer pool
+	if (mapped) {
+		mapFile(r->data, r->mode == 'w');
+		mapFile(r->ovflow, r->mode == 'w');
+	}
+	// asking for direct I/O and quietly getting the page cache
+	//  would make any timing meaningless, so refuse instead
+	else if (direct && (directFile(r->data) != OK
+	                    || directFile(r->ovflow) != OK)) {
+		Count bs = directPageSize(r->data);
+		if (bs == 0 || r->pagesize % bs == 0)
+			sprintf(msg, "Direct I/O isn't supported for %s", name);
+		else
+			sprintf(msg, "Direct I/O needs a page size that is a multiple"
+			        " of %u bytes, not %u (see create -p)", bs, r->pagesize);
+		fatal(msg);
+	}
+	if (r->wal != NULL) {
+		bufSetLogging(r->data, TRUE);
+		bufSetLogging(r->ovflow, TRUE);
+	}
 	return r;
 }
 
+// Changes are made to pages in the buffer pool, which holds them
+//  until they are in the log (see wal.c and bufpool.c)
+// Operations are committed in groups: after WALGROUP operations,
+//  or when too many pool frames are waiting, the changed pages
+//  and the new .info contents are logged and the log is synced
+// A checkpoint writes everything back to the files and empties
+//  the log, whenever the log gets too big and on closeRelation()
+
+// write back all pages and .info, then empty the log
+
+static void checkpoint(Reln r)
+{
+	bufFlush(r->data);
+	bufFlush(r->ovflow);
+	syncFile(r->data);
+	syncFile(r->ovflow);
+	writeInfo(r);
+	syncFile(r->info);
+	walReset(r->wal);
+}
+
+// let readers in other processes see the last group
+
+static void publish(Reln r)
+{
+	setVersion(r, r->version+1);
+	bufFlush(r->data);
+	bufFlush(r->ovflow);
+	writeInfo(r);
+	setVersion(r, r->version+1);
+}
+
+// log all changes since the last commit, and commit them
+
+static void commitGroup(Reln r)
+{
+	char buf[INFOSIZE];
+	walLogFile(r->wal, r->data, WAL_DATA);
+	walLogFile(r->wal, r->ovflow, WAL_OVFLOW);
+	infoImage(r, buf);
+	walCommit(r->wal, buf, INFOSIZE);
+	publish(r);
+	pthread_mutex_lock(&r->lock);
+	r->nops = 0;
+	pthread_mutex_unlock(&r->lock);
+	if (walSize(r->wal) > WALMAXSIZE) checkpoint(r);
+}
+
+// is it time to commit?
+
+static Bool commitDue(Reln r)
+{
+	return (r->nops >= WALGROUP || bufUnlogged() >= NBUFFERS/2);
+}
+
+// nops update operations have finished; commit if it's time to
+// a commit waits for all inserts under way to finish
+
+static void endOperation(Reln r, Count nops)
+{
+	if (r->wal == NULL) return;
+	pthread_mutex_lock(&r->lock);
+	r->nops += nops;
+	Bool due = commitDue(r);
+	pthread_mutex_unlock(&r->lock);
+	if (!due) return;
+	pthread_rwlock_wrlock(&r->shape);
+	// another thread may have committed first
+	pthread_mutex_lock(&r->lock);
+	due = commitDue(r);
+	pthread_mutex_unlock(&r->lock);
+	if (due) commitGroup(r);
+	pthread_rwlock_unlock(&r->shape);
+}
+
 // release files and descriptor for an open relation
 // copy latest information to .info file
 
 void closeRelation(Reln r)
 {
 	// make sure updated global data is put in info
-	// Naughty: assumes Count and Offset are the same size
-	if (r->mode == 'w') {
-		fseek(r->info, 0, SEEK_SET);
-		// write out core relation info (#attr,#pages,d,sp)
-		int n = fwrite(r, sizeof(Count), 5, r->info);
-		assert(n == 5);
-		// write out choice vector
-		n = fwrite(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
-		assert(n == MAXCHVEC);
+	if (r->wal != NULL) {
+		commitGroup(r);
+		checkpoint(r);
+		bufSetLogging(r->data, FALSE);
+		bufSetLogging(r->ovflow, FALSE);
+		walClose(r->wal);
 	}
+	else if (r->mode == 'w')
+		writeInfo(r);
+	closePageFile(r->data);
+	closePageFile(r->ovflow);
 	fclose(r->info);
 	fclose(r->data);
 	fclose(r->ovflow);
+	freeHashPlan(&r->plan);
+	Count i;
+	pthread_rwlock_destroy(&r->shape);
+	pthread_mutex_destroy(&r->lock);
+	pthread_mutex_destroy(&r->ovlock);
+	pthread_mutex_destroy(&r->splitmu);
+	for (i = 0; i < NLATCH; i++) pthread_mutex_destroy(&r->latch[i]);
 	free(r);
 }
 
+// Overflow pages that are no longer in any bucket's chain are kept
+//  on a free list, linked through their ovflow fields; freeov and
+//  nfree in the .info file give its head and length
+// New overflow pages come from the free list before the file grows
+// Both are guarded by ovlock, since any bucket may need a page
+
+// get an empty overflow page, reusing a freed one if possible
+
+static PageID newOvflowPage(Reln r)
+{
+	PageID pid;
+	pthread_mutex_lock(&r->ovlock);
+	if (r->freeov == NO_PAGE)
+		pid = addPage(r->ovflow);
+	else {
+		pid = r->freeov;
+		Page pg = getPage(r->ovflow, pid);
+		r->freeov = pageOvflow(pg);
+		r->nfree--;
+		releasePage(pg);
+		putPage(r->ovflow, pid, newPage(r->pagesize, r->addrbits == 64));
+	}
+	pthread_mutex_unlock(&r->ovlock);
+	return pid;
+}
+
+// put an overflow page (no longer in any chain) on the free list
+
+void freeOvflowPage(Reln r, PageID pid)
+{
+	Page pg = newPage(r->pagesize, r->addrbits == 64);
+	pthread_mutex_lock(&r->ovlock);
+	pageSetOvflow(pg, r->freeov);
+	putPage(r->ovflow, pid, pg);
+	r->freeov = pid;
+	r->nfree++;
+	pthread_mutex_unlock(&r->ovlock);
+}
+
+// add a tuple with hash h to bucket p
+// tries the primary data page, then each page in the
+//  overflow chain, then adds a new page to end of chain
+// *grew says whether an overflow page was added
+// returns OK, or ~OK if tuple doesn't fit on an empty page
+
+static Status addToBucket(Reln r, PageID p, Tuple t, Bits h, Bool *grew)
+{
+	*grew = FALSE;
+	Page pg = getPage(r->data,p);
+	if (addToPage(pg,t,h) == OK) {
+		putPage(r->data,p,pg);
+		return OK;
+	}
+	// primary data page full; scan overflow chain until we find space
+	// keep previous page pinned, in case we need to link to a new page
+	FILE *prevf = r->data;
+	Page prevpg = pg;
+	PageID prevp = p;
+	PageID ovp = pageOvflow(pg);
+	while (ovp != NO_PAGE) {
+		Page ovpg = getPage(r->ovflow, ovp);
+		releasePage(prevpg);
+		if (addToPage(ovpg,t,h) == OK) {
+			putPage(r->ovflow,ovp,ovpg);
+			return OK;
+		}
+		prevf = r->ovflow; prevpg = ovpg; prevp = ovp;
+		ovp = pageOvflow(ovpg);
+	}
+	// all pages in bucket are full; add another to chain
+	PageID newp = newOvflowPage(r);
+	*grew = TRUE;
+	Page newpg = getPage(r->ovflow,newp);
+	if (addToPage(newpg,t,h) != OK) {
+		// can't add to a new page; we have a problem
+		releasePage(newpg);
+		releasePage(prevpg);
+		return ~OK;
+	}
+	putPage(r->ovflow,newp,newpg);
+	// link to existing chain
+	pageSetOvflow(prevpg,newp);
+	putPage(prevf,prevp,prevpg);
+	return OK;
+}
+
+// which bucket does a tuple with hash h belong in?
+
+PageID bucketOf(Reln r, Bits h)
+{
+	PageID p = (r->depth == 0) ? 0 : getLower(h, r->depth);
+	if (p < r->sp) p = getLower(h, r->depth+1);
+	return p;
+}
+
+// Splits are spread over the inserts that follow them
+// Starting the split of bucket sp only adds the new bucket and moves
+//  the split pointer on, so tuples are hashed to where they will
+//  end up; the ones already in sp are moved to the new bucket a
+//  page or two at a time, by later inserts (see splitWork())
+// Until then, some tuples of the new bucket are still in the old
+//  one, so a scan of the new bucket must look in both (see query.c)
+// Only one split is under way at a time: if another is due first,
+//  the rest of this one is done then and there
+//
+// addToRelation() can be called by several threads at once:
+// - each insert holds the shape lock shared, so depth, sp and
+//   npages don't change under it, and the latch of its bucket
+//   while it changes that bucket's pages
+// - the thread whose insert makes a split due becomes the split
+//   coordinator: it takes the shape lock exclusively, so starting
+//   a split waits for the inserts under way
+// - moving tuples (splitStep()) takes the latches of both buckets
+// - a group commit also takes the shape lock exclusively, so it
+//   logs no half-changed pages
+// Everything else (batches, bulk loads, compaction) is for a
+//  single thread only
+// The split under way is kept in .info, so it survives closing
+
+// Compacting a bucket streams through its chain once, copying each
+//  tuple onto a sequence of in-memory pages, first-fit as
+//  addToBucket() would
+// Each output page is then written once: the primary page stays
+//  where it is, overflow pages re-use the old chain's pages
+//  before taking new ones, and any left over are freed
+
+// a sequence of in-memory pages, for the output bucket
+typedef struct PageSeq {
+	Page  *pages;
+	Count  n;     // #pages in use
+	Count  max;   // #pages allocated
+} PageSeq;
+
+static void seqInit(Reln r, PageSeq *s)
+{
+	s->max = 4;
+	s->pages = malloc(s->max*sizeof(Page));
+	assert(s->pages != NULL);
+	s->pages[0] = newPage(r->pagesize, r->addrbits == 64);
+	s->n = 1;
+}
+
+// put tuple t (hash h) on the first page in s with room for it
+// returns ~OK if it doesn't fit on an empty page
+
+static Status seqAdd(Reln r, PageSeq *s, Tuple t, Bits h)
+{
+	Count i;
+	for (i = 0; i < s->n; i++)
+		if (addToPage(s->pages[i], t, h) == OK) return OK;
+	if (s->n == s->max) {
+		s->max *= 2;
+		s->pages = realloc(s->pages, s->max*sizeof(Page));
+		assert(s->pages != NULL);
+	}
+	s->pages[s->n++] = newPage(r->pagesize, r->addrbits == 64);
+	return addToPage(s->pages[s->n-1], t, h);
+}
+
+// link the pages in s into a chain starting at page p of file f,
+//  and ending with a link to next, and write each of them; other
+//  overflow pages come from old[] first
+// *nused counts the pages of old[] taken so far
+// returns #pages written
+
+static Count seqWrite(Reln r, PageSeq *s, FILE *f, PageID p, PageID next,
+                      PageID *old, Count nold, Count *nused)
+{
+	Count i;
+	PageID *ids = malloc(s->n*sizeof(PageID));
+	assert(ids != NULL);
+	ids[0] = p;
+	for (i = 1; i < s->n; i++)
+		ids[i] = (*nused < nold) ? old[(*nused)++] : newOvflowPage(r);
+	for (i = 0; i < s->n; i++) {
+		pageSetOvflow(s->pages[i], (i+1 < s->n) ? ids[i+1] : next);
+		putPage((i == 0) ? f : r->ovflow, ids[i], s->pages[i]);
+	}
+	free(ids);
+	free(s->pages);
+	return s->n;
+}
+
+// rewrite the tuples of bucket p into as few pages as possible
+// *nread and *nwritten are set to the #pages read and written
+// returns OK, or ~OK if a tuple won't fit on an empty page
+
+static Status rewriteBucket(Reln r, PageID p, Count *nread, Count *nwritten)
+{
+	PageSeq out;
+	seqInit(r, &out);
+	Count nold = 0, maxold = 8;
+	PageID *old = malloc(maxold*sizeof(PageID));
+	assert(old != NULL);
+
+	Status ok = OK;
+	FILE *f = r->data;
+	PageID pid = p;
+	*nread = 0;
+	while (pid != NO_PAGE) {
+		Page pg = getPage(f, pid);
+		(*nread)++;
+		Count i, n = pageNTuples(pg);
+		for (i = 0; i < n; i++) {
+			if (seqAdd(r, &out, pageTuple(pg, i), pageTupleHash(pg, i)) != OK)
+				ok = ~OK;
+		}
+		if (f == r->ovflow) {
+			if (nold == maxold) {
+				maxold *= 2;
+				old = realloc(old, maxold*sizeof(PageID));
+				assert(old != NULL);
+			}
+			old[nold++] = pid;
+		}
+		f = r->ovflow;
+		pid = pageOvflow(pg);
+		releasePage(pg);
+	}
+
+	Count nused = 0;
+	*nwritten = seqWrite(r, &out, r->data, p, NO_PAGE, old, nold, &nused);
+	while (nused < nold) {
+		freeOvflowPage(r, old[nused++]);
+		(*nwritten)++;
+	}
+	free(old);
+	return ok;
+}
+
+// the file has one more bucket; move the split pointer on
+
+static void advanceSplit(Reln r)
+{
+	r->npages++;
+	r->sp++;
+	if (r->sp == ((PageID)1 << r->depth)) {
+		r->depth++;
+		r->sp = 0;
+	}
+}
+
+static Status addAllToBucket(Reln r, PageID p, Tuple *ts, Bits *hs, Count n,
+                             Count *nwritten);
+
+// find the page before splitcur in splitold's chain
+
+static void findSplitPrev(Reln r)
+{
+	FILE *f = r->data;
+	PageID pid = r->splitold;
+	for (;;) {
+		Page pg = getPage(f, pid);
+		PageID next = pageOvflow(pg);
+		releasePage(pg);
+		assert(next != NO_PAGE);
+		if (next == r->splitcur) break;
+		f = r->ovflow; pid = next;
+	}
+	r->splitprev = pid;
+	r->splitprevov = (f == r->ovflow);
+}
+
+// move the tuples that now belong in the new bucket off the next
+//  npg pages of the bucket being split
+// the tuples kept are packed onto the first of those pages, first-
+//  fit as in rewriteBucket(), and pages left over are freed; if
+//  none are kept, the pages are taken out of the chain altogether
+//  (unless the first is the primary page, which stays, empty)
+// the moved tuples are added to the new bucket together, so each
+//  of its pages is written at most once per call
+// the page before splitcur is needed to unlink pages; it isn't
+//  kept in .info, so after reopening it is found from the chain
+
+static void splitStep(Reln r, Count npg)
+{
+	// take the two buckets' latches in a fixed order
+	pthread_mutex_t *l1 = &r->latch[r->splitold % NLATCH];
+	pthread_mutex_t *l2 = &r->latch[r->splitnew % NLATCH];
+	if (l1 > l2) { pthread_mutex_t *tmp = l1; l1 = l2; l2 = tmp; }
+	pthread_mutex_lock(l1);
+	if (l2 != l1) pthread_mutex_lock(l2);
+	if (r->splitcurov && r->splitprev == NO_PAGE) findSplitPrev(r);
+	FILE *f0 = r->splitcurov ? r->ovflow : r->data;
+	Count i, nmove = 0, maxmove = 64, nkept = 0, nids = 0, maxids = 8;
+	Tuple *ts = malloc(maxmove*sizeof(Tuple));
+	Bits *hs = malloc(maxmove*sizeof(Bits));
+	PageID *ids = malloc(maxids*sizeof(PageID));  // pages visited
+	assert(ts != NULL && hs != NULL && ids != NULL);
+	PageSeq keep;
+	seqInit(r, &keep);
+	while (npg-- > 0 && r->splitcur != NO_PAGE) {
+		Page pg = getPage(r->splitcurov ? r->ovflow : r->data, r->splitcur);
+		r->splitreads++;
+		Count n = pageNTuples(pg);
+		for (i = 0; i < n; i++) {
+			Bits h = pageTupleHash(pg, i);
+			if (bucketOf(r, h) != r->splitnew) {
+				// it was on a page, so it fits on an empty one
+				Status ok = seqAdd(r, &keep, pageTuple(pg, i), h);
+				assert(ok == OK);
+				nkept++;
+				continue;
+			}
+			if (nmove == maxmove) {
+				maxmove *= 2;
+				ts = realloc(ts, maxmove*sizeof(Tuple));
+				hs = realloc(hs, maxmove*sizeof(Bits));
+				assert(ts != NULL && hs != NULL);
+			}
+			ts[nmove] = copyTuple(pageTuple(pg, i));
+			hs[nmove++] = h;
+		}
+		if (nids == maxids) {
+			maxids *= 2;
+			ids = realloc(ids, maxids*sizeof(PageID));
+			assert(ids != NULL);
+		}
+		ids[nids++] = r->splitcur;
+		r->splitcur = pageOvflow(pg);
+		r->splitcurov = TRUE;
+		releasePage(pg);
+	}
+
+	Bool firstov = (f0 == r->ovflow);
+	if (nmove == 0 && keep.n == nids) {
+		// nothing moved, and no page saved: leave the pages alone
+		for (i = 0; i < keep.n; i++) free(keep.pages[i]);
+		free(keep.pages);
+		r->splitprev = ids[nids-1];
+		r->splitprevov = (nids > 1 || firstov);
+	}
+	else if (nkept == 0 && firstov) {
+		// nothing kept: link the page before to the one after
+		FILE *pf = r->splitprevov ? r->ovflow : r->data;
+		Page prev = getPage(pf, r->splitprev);
+		pageSetOvflow(prev, r->splitcur);
+		putPage(pf, r->splitprev, prev);
+		for (i = 0; i < nids; i++) freeOvflowPage(r, ids[i]);
+		r->splitwrites += 1 + nids;
+		free(keep.pages[0]);
+		free(keep.pages);
+	}
+	else {
+		Count nused = 0, nout = keep.n;
+		r->splitwrites += seqWrite(r, &keep, f0, ids[0], r->splitcur,
+		                           ids+1, nids-1, &nused);
+		// the last page written comes before splitcur
+		r->splitprev = (nout <= nids) ? ids[nout-1] : NO_PAGE;
+		r->splitprevov = (nout > 1 || firstov);
+		while (nused < nids-1) {
+			freeOvflowPage(r, ids[1+nused++]);
+			r->splitwrites++;
+		}
+	}
+
+	if (nmove > 0) {
+		Count nwritten = 0;
+		// they came off pages, so each fits on an empty one
+		Status ok = addAllToBucket(r, r->splitnew, ts, hs, nmove, &nwritten);
+		assert(ok == OK);
+		r->splitwrites += nwritten;
+		for (i = 0; i < nmove; i++) free(ts[i]);
+	}
+	free(ts); free(hs); free(ids);
+	if (l2 != l1) pthread_mutex_unlock(l2);
+	pthread_mutex_unlock(l1);
+	if (r->splitcur == NO_PAGE) r->splitold = r->splitnew = NO_PAGE;
+}
+
+// do the rest of the split under way, if there is one
+// (a chain is rarely longer than a batch, so this usually writes
+//  each page of the new bucket once)
+
+#define SPLITBATCH 64
+
+static void finishSplit(Reln r)
+{
+	while (r->splitold != NO_PAGE) splitStep(r, SPLITBATCH);
+}
+
+// do up to npg pages' worth of the split under way
+// if another thread is already doing some, leave it to that one
+
+static void splitWork(Reln r, Count npg)
+{
+	if (pthread_mutex_trylock(&r->splitmu) != 0) return;
+	if (r->splitold != NO_PAGE) splitStep(r, npg);
+	pthread_mutex_unlock(&r->splitmu);
+}
+
+// start splitting bucket sp into buckets sp and sp+2^depth
+
+static void startSplit(Reln r)
+{
+	finishSplit(r);
+	// new bucket goes at the end of the data file
+	PageID np = addPage(r->data);
+	assert(np == r->sp + ((PageID)1 << r->depth));
+	r->splitold = r->splitcur = r->sp;
+	r->splitnew = np;
+	r->splitcurov = FALSE;
+	r->nsplits++;
+	r->splitwrites++;
+	advanceSplit(r);
+}
+
+// repack the tuples in bucket p into as few pages as possible
+// freed overflow pages go on the free list
+// returns OK, or ~OK if a tuple can't be re-inserted
+
+Status compactBucket(Reln r, PageID p)
+{
+	Count nread, nwritten;
+	// tuples still to be moved would be put back in the old bucket
+	finishSplit(r);
+	Status ok = rewriteBucket(r, p, &nread, &nwritten);
+	endOperation(r, 1);
+	return ok;
+}
+
+// number of pages (primary + overflow) in bucket p
+
+Count bucketPages(Reln r, PageID p)
+{
+	Count n = 1;
+	Page pg = getPage(r->data, p);
+	PageID ovp = pageOvflow(pg);
+	releasePage(pg);
+	while (ovp != NO_PAGE) {
+		pg = getPage(r->ovflow, ovp);
+		ovp = pageOvflow(pg);
+		releasePage(pg);
+		n++;
+	}
+	return n;
+}
+
+// Split policies decide when bucket sp is split; the policy and
+//  its parameter are chosen when the relation is created
+// - SPLIT_EVERY: before every param'th insert
+// - SPLIT_LOAD: before an insert that would take the bytes in all
+//   tuples over param% of the space in primary pages
+// - SPLIT_OVFLOW: after an insert that adds an overflow page
+// The first two only depend on the #tuples and #bytes so far,
+//  so batches and bulk loads can tell in advance when they happen
+
+// with ntups tuples of nbytes bytes, would inserting another
+//  tuple of len bytes split first?
+// once every bucket is addressed by all of its hash bits, the
+//  file can't grow any more, and buckets just get longer
+
+static Bool splitDue(Reln r, Total ntups, Total nbytes, Count len)
+{
+	if (r->depth >= r->addrbits) return FALSE;
+	switch (r->policy) {
+	case SPLIT_EVERY:
+		return ((ntups + 1) % r->param == 0);
+	case SPLIT_LOAD:
+		return ((double)(nbytes + len)*100 >
+		        (double)r->param*r->npages*r->pagesize);
+	default:
+		return FALSE;
+	}
+}
+
+// the split coordinator: splits are started one at a time, with
+//  no insert under way
+// under SPLIT_LOAD, a split due for several inserts at about the
+//  same time is only made once
+
+static void coordinateSplit(Reln r)
+{
+	pthread_rwlock_wrlock(&r->shape);
+	if (r->policy != SPLIT_LOAD || splitDue(r, r->ntups, r->nbytes, 0))
+		startSplit(r);
+	pthread_rwlock_unlock(&r->shape);
+}
+
+// Bulk loading (see bulkload.c) builds the files of an empty
+//  relation directly, one bucket at a time, in file order
+// First, bulkInsert() is called for each tuple, to give the
+//  relation the shape that inserting them one by one would
+// The files aren't touched until the first bucket is written
+
+// returns ~OK if r isn't empty or isn't writable
+
+Status beginBulkLoad(Reln r)
+{
+	if (r->ntups != 0 || r->mode != 'w') return ~OK;
+	r->freeov = NO_PAGE; r->nfree = 0;
+	r->splitold = r->splitnew = r->splitcur = NO_PAGE;
+	return OK;
+}
+
+// note a tuple of len bytes that will be loaded
+// returns ~OK if the split policy depends on page contents
+//  (SPLIT_OVFLOW), so the shape can't be worked out
+
+Status bulkInsert(Reln r, Count len)
+{
+	if (r->policy == SPLIT_OVFLOW) return ~OK;
+	if (splitDue(r, r->ntups, r->nbytes, len)) advanceSplit(r);
+	r->ntups++;
+	r->nbytes += len;
+	return OK;
+}
+
+// write bucket p, which must be the next one in the data file,
+//  holding the n tuples ts[] with hashes hs[]
+// tuples fill the primary page, then as many overflow pages as
+//  needed; each page is written once
+// bucket 0 replaces the old contents of both files
+// returns ~OK if some tuple doesn't fit on an empty page
+
+Status addBucketToRelation(Reln r, PageID p, Tuple *ts, Bits *hs, Count n)
+{
+	if (p == 0) {
+		truncatePageFile(r->data, 0);
+		truncatePageFile(r->ovflow, 0);
+		r->nbytes = 0;
+	}
+	Count npg = 1, maxpg = 8, i;
+	Page *pgs = malloc(maxpg*sizeof(Page));
+	assert(pgs != NULL);
+	pgs[0] = newPage(r->pagesize, r->addrbits == 64);
+	Status ok = OK;
+	for (i = 0; i < n; i++) {
+		r->nbytes += tupLength(ts[i]);
+		if (addToPage(pgs[npg-1], ts[i], hs[i]) == OK) continue;
+		if (npg == maxpg) {
+			maxpg *= 2;
+			pgs = realloc(pgs, maxpg*sizeof(Page));
+			assert(pgs != NULL);
+		}
+		pgs[npg++] = newPage(r->pagesize, r->addrbits == 64);
+		if (addToPage(pgs[npg-1], ts[i], hs[i]) != OK) ok = ~OK;
+	}
+	// overflow pages go at the end of the overflow file, in chain order
+	PageID ovp = filePages(r->ovflow);
+	for (i = 0; i+1 < npg; i++) pageSetOvflow(pgs[i], ovp+i);
+	PageID pid = appendPage(r->data, pgs[0]);
+	assert(pid == p);
+	for (i = 1; i < npg; i++) {
+		pid = appendPage(r->ovflow, pgs[i]);
+		assert(pid == ovp+i-1);
+	}
+	free(pgs);
+	return ok;
+}
+
 // insert a new tuple into a relation
 // returns index of bucket where inserted
 // - index always refers to a primary data page
 // - the actual insertion page may be either a data page or an overflow page
 // returns NO_PAGE if insert fails completely
-// TODO: include splitting and file expansion
 
 PageID addToRelation(Reln r, Tuple t)
 {
-	//printf("addToRelation 0\n");
-	
-
-	int capcity = 1024 / (10 * (r->nattrs));
-
-	Bits h, p;
-	if (((r->ntups + 1)% capcity) == 0)
-	{
-		// Get data from old page
-		//printf("addToRelation 1\n");
-		Offset newp = r->sp + (int)(1 << r->depth);
-		Offset oldp = r->sp;
-		
-		Page pg = getPage(dataFile(r), oldp);
-		
-		char *data = pageData(pg);
-		Offset ovg = pageOvflow(pg);
-
-		// Create the first new page with old id
-		Page NewPage1 = newPage();
-		pageSetOvflow(NewPage1, ovg);
-		putPage(r->data, oldp, NewPage1);
-		NewPage1 = getPage(dataFile(r), oldp);
-
-		// Create the second new page with new id
-		Page NewPage2 = newPage();
-		putPage(r->data, newp, NewPage2);
-		NewPage2 = getPage(dataFile(r), newp);
-
-		while (strlen(data) != 0)
-		{	
-			int tuple_length = strlen(data);
-			h = tupleHash(r, data);
-			p = getLower(h, r->depth + 1);
-
-			if (p == r->sp)
-			{
-				if (addToPage(NewPage1, &data[0]) == OK)
-				{
-					putPage(r->data, p, NewPage1);
-					NewPage1 = getPage(r->data, p);
-				}
-				else
-				{
-					if (pageOvflow(NewPage1) == NO_PAGE) {
-						// add first overflow page in chain
-						PageID newp = addPage(r->ovflow);
-						pageSetOvflow(NewPage1,newp);
-						putPage(r->data,p,NewPage1);
-						Page newpg = getPage(r->ovflow,newp);
-						// can't add to a new page; we have a problem
-						if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-						putPage(r->ovflow,newp,newpg);
-						
-					} else {
-						// scan overflow chain until we find space
-						Page ovpg, prevpg = NULL;
-						PageID ovp, prevp = NO_PAGE;
-						ovp = pageOvflow(NewPage1);
-						while (ovp != NO_PAGE) {
-							ovpg = getPage(r->ovflow, ovp);
-							if (addToPage(ovpg,&data[0]) != OK) {
-								prevp = ovp;
-								prevpg = ovpg;
-								ovp = pageOvflow(ovpg);
-							}
-							else {
-								if (prevpg != NULL) free(prevpg);
-								putPage(r->ovflow,ovp,ovpg);
-								break;
-							}
-						}
-						// all overflow pages are full; add another to chain
-						// at this point, there *must* be a prevpg
-						assert(prevpg != NULL);
-						// make new ovflow page
-						PageID newp = addPage(r->ovflow);
-						// insert tuple into new page
-						Page newpg = getPage(r->ovflow,newp);
-						if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-						putPage(r->ovflow,newp,newpg);
-						// link to existing overflow chain
-						pageSetOvflow(prevpg,newp);
-						putPage(r->ovflow,prevp,prevpg);
-
-					}
-				}
-			}
-			else
-			{
-				if (addToPage(NewPage2, &data[0]) == OK)
-				{
-					putPage(r->data, p, NewPage2);
-					//printf("addToRelation 7\n");
-					NewPage2 = getPage(r->data, p);
-				}
-				else
-				{
-					if (pageOvflow(NewPage1) == NO_PAGE) {
-						// add first overflow page in chain
-						PageID newp = addPage(r->ovflow);
-						pageSetOvflow(NewPage1,newp);
-						putPage(r->data,p,NewPage1);
-						//printf("addToRelation 8\n");
-						Page newpg = getPage(r->ovflow,newp);
-						// can't add to a new page; we have a problem
-						if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-						putPage(r->ovflow,newp,newpg);
-						
-						
-					} else {
-						// scan overflow chain until we find space
-						// worst case: 
-						Page ovpg, prevpg = NULL;
-						PageID ovp, prevp = NO_PAGE;
-						ovp = pageOvflow(NewPage1);
-						while (ovp != NO_PAGE) {
-							//printf("addToRelation 9\n");
-							ovpg = getPage(r->ovflow, ovp);
-							if (addToPage(ovpg,&data[0]) != OK) {
-								prevp = ovp;
-								prevpg = ovpg;
-								ovp = pageOvflow(ovpg);
-							}
-							else {
-								if (prevpg != NULL) free(prevpg);
-								putPage(r->ovflow,ovp,ovpg);
-								break;
-							}
-						}
-
-						// all overflow pages are full; add another to chain
-						// at this point, there *must* be a prevpg
-						assert(prevpg != NULL);
-						// make new ovflow page
-						PageID newp = addPage(r->ovflow);
-						// insert tuple into new page
-						Page newpg = getPage(r->ovflow,newp);
-						if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-						putPage(r->ovflow,newp,newpg);
-						// link to existing overflow chain
-						pageSetOvflow(prevpg,newp);
-						putPage(r->ovflow,prevp,prevpg);
-					}
-				}
-			}
-			data = data + tuple_length + 1;
+	return addHashedToRelation(r, t, tupleHash(r,t));
+}
+
+// insert a new tuple whose hash h is already known
+// (e.g. worked out by another thread; see insert.c)
+
+PageID addHashedToRelation(Reln r, Tuple t, Bits h)
+{
+	Count len = tupLength(t);
+	Bool grew;
+	pthread_rwlock_rdlock(&r->shape);
+	// take this tuple's place in the sequence of inserts
+	pthread_mutex_lock(&r->lock);
+	Bool due = splitDue(r, r->ntups, r->nbytes, len);
+	r->ntups++;
+	r->nbytes += len;
+	pthread_mutex_unlock(&r->lock);
+	if (due) {
+		pthread_rwlock_unlock(&r->shape);
+		coordinateSplit(r);
+		pthread_rwlock_rdlock(&r->shape);
+	}
+	PageID p = bucketOf(r, h);
+	pthread_mutex_t *l = &r->latch[p % NLATCH];
+	pthread_mutex_lock(l);
+	Status ok = addToBucket(r, p, t, h, &grew);
+	pthread_mutex_unlock(l);
+	if (ok != OK) {
+		pthread_mutex_lock(&r->lock);
+		r->ntups--;
+		r->nbytes -= len;
+		pthread_mutex_unlock(&r->lock);
+		p = NO_PAGE;
+	}
+	splitWork(r, SPLITWORK);
+	pthread_rwlock_unlock(&r->shape);
+	if (ok == OK && r->policy == SPLIT_OVFLOW && grew) coordinateSplit(r);
+	// even a failed insert may have changed pages
+	endOperation(r, 1);
+	return p;
+}
+
+// add tuples ts[0..n-1], with hashes hs[], all to bucket p
+// goes along the bucket's chain, putting each tuple on the first
+//  page with room (as addToBucket() would), but reading and
+//  writing each page at most once
+// *nwritten is increased by the #pages written
+// returns OK, or ~OK if some tuple doesn't fit on an empty page
+
+static Status addAllToBucket(Reln r, PageID p, Tuple *ts, Bits *hs, Count n,
+                             Count *nwritten)
+{
+	Count *left = malloc(n*sizeof(Count));
+	assert(left != NULL);
+	Count nleft = n, i;
+	for (i = 0; i < n; i++) left[i] = i;
+	Status ok = OK;
+	FILE *f = r->data;
+	PageID pid = p;
+	Page pg = getPage(f, pid);
+	Bool fresh = FALSE;
+	for (;;) {
+		// tuples that don't fit here stay in left[]
+		Count m = 0;
+		for (i = 0; i < nleft; i++)
+			if (addToPage(pg, ts[left[i]], hs[left[i]]) != OK)
+				left[m++] = left[i];
+		Bool changed = (m < nleft);
+		nleft = m;
+		if (fresh && !changed && nleft > 0) {
+			// not even an empty page has room for the first one;
+			//  drop it and try the rest here again
+			ok = ~OK;
+			memmove(left, left+1, (--nleft)*sizeof(Count));
+			if (nleft > 0) continue;
 		}
-		
-		while (ovg != NO_PAGE)
-		{
-			Page ovg_pg = getPage(ovflowFile(r), ovg);
-			Offset overflowpage = pageOvflow(ovg_pg);
-			char *data = pageData(ovg_pg);
-			Page ovppn = newPage();
-			pageSetOvflow(ovppn, overflowpage);
-			putPage(r->ovflow, ovg, ovppn);
-			while (strlen(data) != 0)
-			{
-				int tuple_length = strlen(data);
-				h = tupleHash(r, data);
-				p = getLower(h, r->depth + 1);
-				if (p == r->sp)
-				{
-					//printf("addToRelation 11\n");
-					NewPage1 = getPage(r->data, p);
-					int judge = 0;
-					if (addToPage(NewPage1, &data[0]) == OK) {
-						putPage(r->data, p, NewPage1);
-						NewPage1 = getPage(r->data, p);
-						judge = 1;
-					} else {
-						
-						if (pageOvflow(NewPage1) == NO_PAGE) {
-							// add first overflow page in chain
-							PageID newp = addPage(r->ovflow);
-							pageSetOvflow(NewPage1,newp);
-							putPage(r->data,p,NewPage1);
-							//printf("addToRelation 5\n");
-							Page newpg = getPage(r->ovflow,newp);
-							// can't add to a new page; we have a problem
-							if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-							putPage(r->ovflow,newp,newpg);
-							judge = 1;
-						} else {
-							// scan overflow chain until we find space
-							Page ovpg, prevpg = NULL;
-							PageID ovp, prevp = NO_PAGE;
-							ovp = pageOvflow(NewPage1);
-							while (ovp != NO_PAGE) {
-								//printf("addToRelation 6\n");
-								ovpg = getPage(r->ovflow, ovp);
-								if (addToPage(ovpg,&data[0]) != OK) {
-									prevp = ovp;
-									prevpg = ovpg;
-									ovp = pageOvflow(ovpg);
-								}
-								else {
-									if (prevpg != NULL) free(prevpg);
-									putPage(r->ovflow,ovp,ovpg);
-									judge = 1;
-									break;
-								}
-							}
-							if (judge == 0) {
-								// all overflow pages are full; add another to chain
-								// at this point, there *must* be a prevpg
-								assert(prevpg != NULL);
-								// make new ovflow page
-								PageID newp = addPage(r->ovflow);
-								// insert tuple into new page
-								Page newpg = getPage(r->ovflow,newp);
-								if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-								putPage(r->ovflow,newp,newpg);
-								// link to existing overflow chain
-								pageSetOvflow(prevpg,newp);
-								putPage(r->ovflow,prevp,prevpg);
-
-								free(ovpg);
-								judge = 1;
-							}
-
-						}
-					}
-
-				}
-				else
-				{
-					NewPage2 = getPage(r->data, p);
-					int judge = 0;
-					if (addToPage(NewPage2, &data[0]) == OK) {
-						putPage(r->data, p, NewPage2);
-						NewPage2 = getPage(r->data, p);
-						judge = 1;
-					} else {
-						if (pageOvflow(NewPage2) == NO_PAGE) {
-							// add first overflow page in chain
-							PageID newp = addPage(r->ovflow);
-							pageSetOvflow(NewPage2,newp);
-							putPage(r->data,p,NewPage2);
-							//printf("addToRelation 5\n");
-							Page newpg = getPage(r->ovflow,newp);
-							// can't add to a new page; we have a problem
-							if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-							putPage(r->ovflow,newp,newpg);
-							judge = 1;
-						} else {
-							// scan overflow chain until we find space 
-							Page ovpg, prevpg = NULL;
-							PageID ovp, prevp = NO_PAGE;
-							ovp = pageOvflow(NewPage2);
-							while (ovp != NO_PAGE) {
-								ovpg = getPage(r->ovflow, ovp);
-								if (addToPage(ovpg,&data[0]) != OK) {
-									prevp = ovp;
-									prevpg = ovpg;
-									ovp = pageOvflow(ovpg);
-								}
-								else {
-									if (prevpg != NULL) free(prevpg);
-									putPage(r->ovflow,ovp,ovpg);
-									judge = 1;
-									break;
-								}
-							}
-							if (judge == 0) {
-								// all overflow pages are full; add another to chain
-								// at this point, there *must* be a prevpg
-								assert(prevpg != NULL);
-								// make new ovflow page
-								PageID newp = addPage(r->ovflow);
-								// insert tuple into new page
-								Page newpg = getPage(r->ovflow,newp);
-								if (addToPage(newpg,&data[0]) != OK) return NO_PAGE;
-								putPage(r->ovflow,newp,newpg);
-								// link to existing overflow chain
-								pageSetOvflow(prevpg,newp);
-								putPage(r->ovflow,prevp,prevpg);
-
-								free(ovpg);
-								judge = 1;
-							}
-
-						}
-					}
-					
-				}
-				data = data + tuple_length + 1;
-			}
-			ovg = pageOvflow(ovg_pg);
+		if (nleft == 0) {
+			if (changed) putPage(f, pid, pg); else releasePage(pg);
+			if (changed) (*nwritten)++;
+			break;
 		}
-		
-		r->npages = r->npages + 1;
-		r->sp = r->sp + 1;
-		if (r->sp == (int)(1 << r->depth))
-		{
-			r->depth = r->depth + 1;
-			r->sp = 0;
+		PageID next = pageOvflow(pg);
+		fresh = (next == NO_PAGE);
+		if (fresh) {
+			next = newOvflowPage(r);
+			pageSetOvflow(pg, next);
+			changed = TRUE;
 		}
+		if (changed) putPage(f, pid, pg); else releasePage(pg);
+		if (changed) (*nwritten)++;
+		f = r->ovflow; pid = next;
+		pg = getPage(f, pid);
 	}
+	free(left);
+	return ok;
+}
 
-	//Bits h, p;
-	// char buf[MAXBITS+1];
-	h = tupleHash(r,t);
-	if (r->depth == 0)
-		p = 1;
-	else {
-		p = getLower(h, r->depth);
-		if (p < r->sp) p = getLower(h, r->depth+1);
-	}
-	// bitsString(h,buf); printf("hash = %s\n",buf);
-	// bitsString(p,buf); printf("page = %s\n",buf);
-	Page pg = getPage(r->data,p);
-	if (addToPage(pg,t) == OK) {
-		putPage(r->data,p,pg);
-		r->ntups++;
-		return p;
-	}
-	// primary data page full
-	if (pageOvflow(pg) == NO_PAGE) {
-		// add first overflow page in chain
-		PageID newp = addPage(r->ovflow);
-		pageSetOvflow(pg,newp);
-		putPage(r->data,p,pg);
-		Page newpg = getPage(r->ovflow,newp);
-		// can't add to a new page; we have a problem
-		if (addToPage(newpg,t) != OK) return NO_PAGE;
-		putPage(r->ovflow,newp,newpg);
-		r->ntups++;
-		return p;
+// a tuple from a batch, and the bucket it goes in
+typedef struct BatchItem {
+	PageID bucket;
+	Count  i;      // index in batch
+} BatchItem;
+
+static int cmpBatchItem(const void *a, const void *b)
+{
+	const BatchItem *x = a, *y = b;
+	if (x->bucket != y->bucket) return (x->bucket > y->bucket) ? 1 : -1;
+	return (x->i > y->i) - (x->i < y->i);
+}
+
+// insert tuples ts[0..n-1] into a relation
+// the tuples are all hashed first (see tupleHashBatch())
+// splits happen just where they would for n calls of addToRelation()
+// between splits, tuples are grouped by bucket, and each bucket
+//  gets all of its tuples at once (see addAllToBucket())
+// under SPLIT_OVFLOW, splits can't be foreseen, so the tuples are
+//  just inserted one at a time
+// returns OK, or ~OK if some insert fails
+
+Status addBatchToRelation(Reln r, Tuple *ts, Count n)
+{
+	Count i, j;
+	Bits *hs = malloc(n*sizeof(Bits));
+	assert(hs != NULL);
+	tupleHashBatch(r, ts, n, hs);
+	if (r->policy == SPLIT_OVFLOW) {
+		Status ok = OK;
+		for (i = 0; i < n && ok == OK; i++)
+			if (addHashedToRelation(r, ts[i], hs[i]) == NO_PAGE) ok = ~OK;
+		free(hs);
+		return ok;
 	}
-	else {
-		// scan overflow chain until we find space
-		// worst case: add new ovflow page at end of chain
-		Page ovpg, prevpg = NULL;
-		PageID ovp, prevp = NO_PAGE;
-		ovp = pageOvflow(pg);
-		while (ovp != NO_PAGE) {
-			ovpg = getPage(r->ovflow, ovp);
-			if (addToPage(ovpg,t) != OK) {
-				prevp = ovp; prevpg = ovpg;
-				ovp = pageOvflow(ovpg);
-			}
-			else {
-				if (prevpg != NULL) free(prevpg);
-				putPage(r->ovflow,ovp,ovpg);
-				r->ntups++;
-				return p;
+
+	BatchItem *items = malloc(n*sizeof(BatchItem));
+	Tuple *bts = malloc(n*sizeof(Tuple));
+	Bits *bhs = malloc(n*sizeof(Bits));
+	assert(items != NULL && bts != NULL && bhs != NULL);
+
+	Status ok = OK;
+	Count done = 0, nwritten = 0;
+	while (done < n) {
+		if (splitDue(r, r->ntups, r->nbytes, tupLength(ts[done])))
+			startSplit(r);
+		// all tuples up to the next split see the same depth and sp
+		Count nseg = 1;
+		Total nt = r->ntups + 1;
+		Total nbytes = r->nbytes + tupLength(ts[done]);
+		while (done + nseg < n
+		       && !splitDue(r, nt, nbytes, tupLength(ts[done+nseg]))) {
+			nbytes += tupLength(ts[done+nseg]);
+			nt++; nseg++;
+		}
+		for (i = 0; i < nseg; i++) {
+			items[i].bucket = bucketOf(r, hs[done+i]);
+			items[i].i = done+i;
+		}
+		qsort(items, nseg, sizeof(BatchItem), cmpBatchItem);
+		for (i = 0; i < nseg; i = j) {
+			Count nb = 0;
+			for (j = i; j < nseg && items[j].bucket == items[i].bucket; j++) {
+				bts[nb] = ts[items[j].i];
+				bhs[nb] = hs[items[j].i];
+				nb++;
 			}
+			if (addAllToBucket(r, items[i].bucket, bts, bhs, nb, &nwritten) != OK)
+				ok = ~OK;
 		}
-		// all overflow pages are full; add another to chain
-		// at this point, there *must* be a prevpg
-		assert(prevpg != NULL);
-		// make new ovflow page
-		PageID newp = addPage(r->ovflow);
-		// insert tuple into new page
-		Page newpg = getPage(r->ovflow,newp);
-        if (addToPage(newpg,t) != OK) return NO_PAGE;
-        putPage(r->ovflow,newp,newpg);
-		// link to existing overflow chain
-		pageSetOvflow(prevpg,newp);
-		putPage(r->ovflow,prevp,prevpg);
-        r->ntups++;
-		return p;
-	}
-	return NO_PAGE;
+		r->ntups += nseg;
+		r->nbytes = nbytes;
+		done += nseg;
+		splitWork(r, nseg*SPLITWORK);
+		endOperation(r, nseg);
+	}
+	free(hs); free(items); free(bts); free(bhs);
+	return ok;
 }
 
 // external interfaces for Reln data
@@ -496,11 +1322,36 @@ PageID addToRelation(Reln r, Tuple t)
 FILE *dataFile(Reln r) { return r->data; }
 FILE *ovflowFile(Reln r) { return r->ovflow; }
 Count nattrs(Reln r) { return r->nattrs; }
-Count npages(Reln r) { return r->npages; }
-Count ntuples(Reln r) { return r->ntups; }
+PageID npages(Reln r) { return r->npages; }
+Total ntuples(Reln r) { return r->ntups; }
 Count depth(Reln r)  { return r->depth; }
-Count splitp(Reln r) { return r->sp; }
+PageID splitp(Reln r) { return r->sp; }
+Count pagesize(Reln r) { return r->pagesize; }
+Count splitPolicy(Reln r) { return r->policy; }
 ChVecItem *chvec(Reln r)  { return r->cv; }
+HashPlan *hashPlan(Reln r) { return &r->plan; }
+PageID splitOld(Reln r) { return r->splitold; }
+PageID splitNew(Reln r) { return r->splitnew; }
+Bool sharedRelation(Reln r) { return r->shared; }
+Count hashId(Reln r) { return r->hashid; }
+Count addrBits(Reln r) { return r->addrbits; }
+
+// has a writer published changes since r's .info was read?
+
+Bool relationChanged(Reln r)
+{
+	return (readVersion(r) != r->version);
+}
+
+// catch up with a writer's changes: read .info again, and forget
+//  all pages read before
+
+void refreshRelation(Reln r)
+{
+	loadInfo(r);
+	bufDrop(r->data);
+	bufDrop(r->ovflow);
+}
 
 
 // displays info about open Reln
@@ -508,30 +1359,82 @@ ChVecItem *chvec(Reln r)  { return r->cv; }
 void relationStats(Reln r)
 {
 	printf("Global Info:\n");
-	printf("#attrs:%d  #pages:%d  #tuples:%d  d:%d  sp:%d\n",
-	       r->nattrs, r->npages, r->ntups, r->depth, r->sp);
+	printf("#attrs:%d  #pages:%lu  #tuples:%lu  d:%d  sp:%lu  pagesize:%d\n",
+	       r->nattrs, r->npages, r->ntups, r->depth, r->sp, r->pagesize);
+	printf("hash: %s  address bits: %d\n", hashName(r->hashid), r->addrbits);
 	printf("Choice vector\n");
-	printChVec(r->cv);
+	printChVec(r->cv, r->addrbits);
 	printf("Bucket Info:\n");
 	printf("%-4s %s\n","#","Info on pages in bucket");
 	printf("%-4s %s\n","","(pageID,#tuples,freebytes,ovflow)");
-	for (Offset pid = 0; pid < r->npages; pid++) {
-		printf("[%2d]  ",pid);
+	for (PageID pid = 0; pid < r->npages; pid++) {
+		printf("[%2lu]  ",pid);
 		Page p = getPage(r->data, pid);
 		Count ntups = pageNTuples(p);
 		Count space = pageFreeSpace(p);
-		Offset ovid = pageOvflow(p);
-		printf("(d%d,%d,%d,%d)",pid,ntups,space,ovid);
-		free(p);
+		PageID ovid = pageOvflow(p);
+		printf("(d%lu,%d,%d,%ld)",pid,ntups,space,(long)ovid);
+		releasePage(p);
 		while (ovid != NO_PAGE) {
-			Offset curid = ovid;
+			PageID curid = ovid;
 			p = getPage(r->ovflow, ovid);
 			ntups = pageNTuples(p);
 			space = pageFreeSpace(p);
 			ovid = pageOvflow(p);
-			printf(" -> (ov%d,%d,%d,%d)",curid,ntups,space,ovid);
-			free(p);
+			printf(" -> (ov%lu,%d,%d,%ld)",curid,ntups,space,(long)ovid);
+			releasePage(p);
 		}
 		putchar('\n');
 	}
+	// space in the overflow file that could be put to use
+	Total novpages = 0, slack = 0;
+	for (PageID pid = 0; pid < r->npages; pid++) {
+		Page p = getPage(r->data, pid);
+		PageID ovid = pageOvflow(p);
+		releasePage(p);
+		while (ovid != NO_PAGE) {
+			p = getPage(r->ovflow, ovid);
+			slack += pageFreeSpace(p);
+			ovid = pageOvflow(p);
+			releasePage(p);
+			novpages++;
+		}
+	}
+	printf("Overflow Info:\n");
+	printf("#inuse:%lu  #free:%lu  free list head:%ld\n",
+	       novpages, r->nfree, (long)r->freeov);
+	printf("reclaimable: %lu bytes on free pages, %lu bytes unused in chains\n",
+	       r->nfree*r->pagesize, slack);
+	printf("Split Info:\n");
+	if (r->policy == SPLIT_EVERY)
+		printf("policy: split every %d inserts\n", r->param);
+	else if (r->policy == SPLIT_LOAD)
+		printf("policy: split at load factor %d%%\n", r->param);
+	else
+		printf("policy: split when an overflow page is added\n");
+	printf("#bytes in tuples:%lu  load factor:%.2f\n", r->nbytes,
+	       (double)r->nbytes/((double)r->npages*r->pagesize));
+	printf("#splits:%lu  pages read:%lu  pages written:%lu",
+	       r->nsplits, r->splitreads, r->splitwrites);
+	if (r->nsplits > 0)
+		printf("  (%.2f page I/Os per split)",
+			(double)(r->splitreads + r->splitwrites)/r->nsplits);
+	putchar('\n');
+	if (r->splitold == NO_PAGE)
+		printf("split backlog: none\n");
+	else {
+		// pages of the old bucket not yet visited
+		Total left = 0;
+		PageID pid = r->splitcur;
+		FILE *f = r->splitcurov ? r->ovflow : r->data;
+		while (pid != NO_PAGE) {
+			Page p = getPage(f, pid);
+			pid = pageOvflow(p);
+			releasePage(p);
+			f = r->ovflow;
+			left++;
+		}
+		printf("split backlog: bucket %lu -> %lu, %lu pages still to move\n",
+		       r->splitold, r->splitnew, left);
+	}
 }
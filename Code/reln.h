@@ -8,23 +8,52 @@
 
 typedef struct RelnRep *Reln;
 
+// split policies (see reln.c)
+#define SPLIT_EVERY  0
+#define SPLIT_LOAD   1
+#define SPLIT_OVFLOW 2
+
 #include "defs.h"
+#include "bits.h"
 #include "tuple.h"
 #include "page.h"
 #include "chvec.h"
+#include "hash.h"
 
-Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv);
+Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv,
+                   Count pagesize, Count policy, Count param, Count hashid,
+                   Count addrbits);
 Reln openRelation(char *name, char *mode);
 void closeRelation(Reln r);
 Bool existsRelation(char *name);
 PageID addToRelation(Reln r, Tuple t);
+PageID addHashedToRelation(Reln r, Tuple t, Bits h);
+Status addBatchToRelation(Reln r, Tuple *ts, Count n);
+PageID bucketOf(Reln r, Bits h);
+Status beginBulkLoad(Reln r);
+Status bulkInsert(Reln r, Count len);
+Status addBucketToRelation(Reln r, PageID p, Tuple *ts, Bits *hs, Count n);
+void freeOvflowPage(Reln r, PageID pid);
+Status compactBucket(Reln r, PageID p);
+Count bucketPages(Reln r, PageID p);
 FILE *dataFile(Reln r);
 FILE *ovflowFile(Reln r);
 Count nattrs(Reln r);
-Count npages(Reln r);
+PageID npages(Reln r);
+Total ntuples(Reln r);
 Count depth(Reln r);
-Count splitp(Reln r);
+PageID splitp(Reln r);
+Count pagesize(Reln r);
+Count splitPolicy(Reln r);
 ChVecItem *chvec(Reln r);
+HashPlan *hashPlan(Reln r);
+PageID splitOld(Reln r);
+PageID splitNew(Reln r);
+Bool sharedRelation(Reln r);
+Count hashId(Reln r);
+Count addrBits(Reln r);
+Bool relationChanged(Reln r);
+void refreshRelation(Reln r);
 void relationStats(Reln r);
 
 #endif
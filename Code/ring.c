@@ -0,0 +1,114 @@
+// ring.c ... bounded single-producer/consumer queues
+// part of Multi-attribute Linear-hashed Files
+// Pass fixed-size items from one thread to another without locks
+
+// sched_yield() is not in plain C99
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include "defs.h"
+#include "ring.h"
+
+// A Ring is a circular array of size slots (a power of 2)
+// - only the producer moves head, only the consumer moves tail;
+//   both only ever increase, and wrap around as unsigned ints
+// - an item is copied in before head is moved past it, and out
+//   before tail is moved past it (release/acquire ordering)
+// - the two indexes are on separate cache lines, so the two
+//   threads don't keep taking the line from each other
+// - a full ring makes the producer wait (backpressure), an empty
+//   one makes the consumer wait; waiting threads yield the CPU
+// - once the producer has closed the ring, the consumer gets the
+//   items left in it, then end of queue
+
+#define CACHELINE 64
+
+struct RingRep {
+	Count  head;   // next slot to fill
+	char   pad1[CACHELINE - sizeof(Count)];
+	Count  tail;   // next slot to empty
+	char   pad2[CACHELINE - sizeof(Count)];
+	Count  size;   // #slots
+	Count  itemsize;
+	Bool   closed; // no more items will be put
+	char  *slots;
+};
+
+// make a ring holding up to nitems items of itemsize bytes
+// nitems is rounded up to a power of 2
+
+Ring newRing(Count nitems, Count itemsize)
+{
+	Ring q = malloc(sizeof(struct RingRep));
+	assert(q != NULL);
+	q->size = 1;
+	while (q->size < nitems) q->size *= 2;
+	q->itemsize = itemsize;
+	q->slots = malloc((size_t)q->size*itemsize);
+	assert(q->slots != NULL);
+	q->head = q->tail = 0;
+	q->closed = FALSE;
+	return q;
+}
+
+void freeRing(Ring q)
+{
+	free(q->slots);
+	free(q);
+}
+
+// add an item, if there's room; producer only
+
+Bool ringPut(Ring q, void *item)
+{
+	Count h = q->head;
+	if (h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->size)
+		return FALSE;
+	memcpy(q->slots + (size_t)(h & (q->size-1))*q->itemsize, item, q->itemsize);
+	__atomic_store_n(&q->head, h+1, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+// take an item, if there is one; consumer only
+
+Bool ringGet(Ring q, void *item)
+{
+	Count t = q->tail;
+	if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == t)
+		return FALSE;
+	memcpy(item, q->slots + (size_t)(t & (q->size-1))*q->itemsize, q->itemsize);
+	__atomic_store_n(&q->tail, t+1, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+// add an item, waiting for room; *nwaits counts the waits
+
+void ringPush(Ring q, void *item, Count *nwaits)
+{
+	while (!ringPut(q, item)) {
+		(*nwaits)++;
+		sched_yield();
+	}
+}
+
+// take an item, waiting for one; *nwaits counts the waits
+// returns FALSE once the ring is closed and empty
+
+Bool ringPop(Ring q, void *item, Count *nwaits)
+{
+	for (;;) {
+		if (ringGet(q, item)) return TRUE;
+		// anything put before closing is visible once closed is
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			return ringGet(q, item);
+		(*nwaits)++;
+		sched_yield();
+	}
+}
+
+// no more items will be put; producer only
+
+void ringClose(Ring q)
+{
+	__atomic_store_n(&q->closed, TRUE, __ATOMIC_RELEASE);
+}
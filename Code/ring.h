@@ -0,0 +1,20 @@
+// ring.h ... interface to bounded single-producer/consumer queues
+// part of Multi-attribute Linear-hashed Files
+// See ring.c for details
+
+#ifndef RING_H
+#define RING_H 1
+
+typedef struct RingRep *Ring;
+
+#include "defs.h"
+
+Ring newRing(Count nitems, Count itemsize);
+void freeRing(Ring);
+Bool ringPut(Ring, void *);
+Bool ringGet(Ring, void *);
+void ringPush(Ring, void *, Count *);
+Bool ringPop(Ring, void *, Count *);
+void ringClose(Ring);
+
+#endif
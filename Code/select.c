@@ -1,8 +1,11 @@
 // select.c ... run queries
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named relation
-// Usage:  ./select  [-v]  RelName  v1,v2,v3,v4,...
+// Usage:  ./select  [-v]  [-d]  RelName  v1,v2,v3,v4,...
 // where any of the vi's can be "?" (unknown)
+// -d reads pages with direct I/O instead of mapping the files; the
+//    page size must be a multiple of the file system's block size
+//    (e.g. create -p 4096), or the relation is not opened
 
 #include "defs.h"
 #include "query.h"
@@ -10,7 +13,7 @@
 #include "reln.h"
 #include "chvec.h"
 
-#define USAGE "./select  [-v]  RelName  v1,v2,v3,v4,..."
+#define USAGE "./select  [-v]  [-d]  RelName  v1,v2,v3,v4,..."
 
 // Main ... process args, run query
 
@@ -23,16 +26,23 @@ int main(int argc, char **argv)
 	int verbose;  // show extra info on query progress
 	char *rname;  // name of table/file
 	char *qstr;   // query string
+	char *mode;   // how to open relation
 
 	// process command-line args
 
-	if (argc < 3) fatal(USAGE);
-	if (strcmp(argv[1], "-v") == 0) {
-		verbose = 1;  rname = argv[2];  qstr = argv[3];
-	}
-	else {
-		verbose = 0;  rname = argv[1];  qstr = argv[2];
+	int a = 1;
+	verbose = 0; mode = "rm";
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-d") == 0)
+			mode = "rd";
+		else
+			fatal(USAGE);
+		a++;
 	}
+	if (argc - a < 2) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];
 
 	if (verbose) { /* keeps compiler quiet */ }
 
@@ -42,7 +52,7 @@ int main(int argc, char **argv)
 		sprintf(err, "No such relation: %s",rname);
 		fatal(err);
 	}
-	if ((r = openRelation(rname,"r")) == NULL) {
+	if ((r = openRelation(rname,mode)) == NULL) {
 		sprintf(err, "Can't open relation: %s",rname);
 		fatal(err);
 	}
@@ -57,6 +67,7 @@ int main(int argc, char **argv)
 	while ((t = getNextTuple(q)) != NULL) {
 		tupleString(t,tup);
 		printf("%s\n",tup);
+		free(t);
 	}
 
 	// clean up
@@ -9,11 +9,88 @@
 #include "chvec.h"
 #include "bits.h"
 
-// return number of bytes/chars in a tuple
+// A Tuple is stored in a binary form, built once by makeTuple()
+// - a count of attributes, natts
+// - an offset vector off[0..natts], relative to start of tuple;
+//   attribute i occupies bytes off[i] .. off[i+1]-1
+// - the attribute values, each terminated by '\0'
+// so off[natts] is the length of the whole tuple, and the length
+//  of attribute i (without its '\0') is off[i+1]-off[i]-1
+// All fields are unsigned shorts, so tuples must be 2-byte aligned
+
+typedef unsigned short TupField;
+
+#define tupField(t,i) (((TupField *)(t))[i])
+
+// return number of bytes in a tuple
 
 int tupLength(Tuple t)
 {
-	return strlen(t);
+	Count n = tupField(t,0);
+	return tupField(t,n+1);
+}
+
+// number of attributes in a tuple
+
+Count tupleNAttrs(Tuple t)
+{
+	return tupField(t,0);
+}
+
+// value of i'th attribute, as a '\0'-terminated string
+
+char *tupleAttr(Tuple t, Count i)
+{
+	assert(i < tupField(t,0));
+	return t + tupField(t,i+1);
+}
+
+// length of i'th attribute, not counting '\0'
+
+Count tupleAttrLength(Tuple t, Count i)
+{
+	assert(i < tupField(t,0));
+	return tupField(t,i+2) - tupField(t,i+1) - 1;
+}
+
+// build a Tuple from a "val_1,val_2,...,val_n" string
+// returns NULL if the string is too long to encode
+
+Tuple makeTuple(char *str)
+{
+	char *c; Count nf = 1;
+	for (c = str; *c != '\0'; c++)
+		if (*c == ',') nf++;
+	Count hdr = (nf+2)*sizeof(TupField);
+	Count len = hdr + strlen(str) + 1;
+	if (len > 0xffff) return NULL;
+	Tuple t = malloc(len);
+	assert(t != NULL);
+	tupField(t,0) = nf;
+	char *v = t + hdr;
+	Count i = 0;
+	for (c = str; ; c++) {
+		if (*c == ',' || *c == '\0') {
+			*v++ = '\0';
+			tupField(t,i+2) = v - t;
+			i++;
+			if (*c == '\0') break;
+		}
+		else
+			*v++ = *c;
+	}
+	tupField(t,1) = hdr;
+	return t;
+}
+
+// make a private copy of a tuple (e.g. one on a page)
+
+Tuple copyTuple(Tuple t)
+{
+	Tuple new = malloc(tupLength(t));
+	assert(new != NULL);
+	memcpy(new, t, tupLength(t));
+	return new;
 }
 
 // reads/parses next tuple in input
@@ -24,37 +101,30 @@ Tuple readTuple(Reln r, FILE *in)
 	if (fgets(line, MAXTUPLEN-1, in) == NULL)
 		return NULL;
 	line[strlen(line)-1] = '\0';
-	// count fields
-	// cheap'n'nasty parsing
-	char *c; int nf = 1;
-	for (c = line; *c != '\0'; c++)
-		if (*c == ',') nf++;
+	return parseTuple(r, line);
+}
+
+// make a Tuple for Reln r from a line of input (without its '\n')
+// returns NULL if it isn't a valid tuple for r
+
+Tuple parseTuple(Reln r, char *line)
+{
+	Tuple t = makeTuple(line); // needs to be free'd sometime
 	// invalid tuple
-	if (nf != nattrs(r)) return NULL;
-	return copyString(line); // needs to be free'd sometime
+	if (t != NULL && tupleNAttrs(t) != nattrs(r)) {
+		free(t);
+		return NULL;
+	}
+	return t;
 }
 
 // extract values into an array of strings
 
 void tupleVals(Tuple t, char **vals)
 {
-	char *c = t, *c0 = t;
-	int i = 0;
-	for (;;) {
-		while (*c != ',' && *c != '\0') c++;
-		if (*c == '\0') {
-			// end of tuple; add last field to vals
-			vals[i++] = copyString(c0);
-			break;
-		}
-		else {
-			// end of next field; add to vals
-			*c = '\0';
-			vals[i++] = copyString(c0);
-			*c = ',';
-			c++; c0 = c;
-		}
-	}
+	Count i, n = tupleNAttrs(t);
+	for (i = 0; i < n; i++)
+		vals[i] = copyString(tupleAttr(t,i));
 }
 
 // release memory used for separate attirubte values
@@ -66,33 +136,52 @@ void freeVals(char **vals, int nattrs)
 }
 
 // hash a tuple using the choice vector
-// TODO: actually use the choice vector to make the hash
+// only attributes that the choice vector uses are hashed, and their
+//  bits are moved into place by the relation's compiled plan (see
+//  compileChVec()); all of r's address bits are made, as the hash
+//  is kept with the tuple for later splits and queries
 
 Bits tupleHash(Reln r, Tuple t)
 {
-	char buf[MAXBITS+1];
-	Count nvals = nattrs(r);
-	ChVecItem *choiceVector = chvec(r);
-	char **vals = malloc(nvals*sizeof(char *));
-	assert(vals != NULL);
-	tupleVals(t, vals);
-	Bits hash = 0;
-	Bits hashval[nvals];
-	for (int i=0;i< nvals; i++) {
-		hashval[i] = hash_any((unsigned char *)vals[i],strlen(vals[i]));
+	HashPlan *plan = hashPlan(r);
+	Bits hashval[nattrs(r)];
+	HashFn hf = hashFunction(hashId(r));
+	for (int i=0;i< plan->natts; i++) {
+		Count a = plan->atts[i];
+		hashval[a] = hf((unsigned char *)tupleAttr(t,a),tupleAttrLength(t,a));
 	}
-	for (int i=0;i < MAXBITS;i++) {
-		int result = bitIsSet(hashval[choiceVector[i].att], choiceVector[i].bit);
-		if (result == 1) {
-			hash = setBit(hash, i);
-		} 
-		if (result == 0) {
-			hash = unsetBit(hash, i);
+	return gatherBits(plan, hashval);
+}
+
+// hash n tuples at once, putting their hashes in hs
+// values are hashed an attribute at a time, HASHBATCH tuples at a
+//  time, with hashBatch(), which may hash several at once (see
+//  hash.c); the hashes are the same as tupleHash() makes
+
+#define HASHBATCH 256
+
+void tupleHashBatch(Reln r, Tuple *ts, Count n, Bits *hs)
+{
+	HashPlan *plan = hashPlan(r);
+	Count na = nattrs(r), id = hashId(r), i, k, m, done;
+	unsigned char *vals[HASHBATCH];
+	int lens[HASHBATCH];
+	uint64_t col[HASHBATCH];
+	Bits hashval[HASHBATCH*na];
+	for (done = 0; done < n; done += m) {
+		m = (n - done < HASHBATCH) ? n - done : HASHBATCH;
+		for (k = 0; k < plan->natts; k++) {
+			Count a = plan->atts[k];
+			for (i = 0; i < m; i++) {
+				vals[i] = (unsigned char *)tupleAttr(ts[done+i],a);
+				lens[i] = tupleAttrLength(ts[done+i],a);
+			}
+			hashBatch(id, vals, lens, m, col);
+			for (i = 0; i < m; i++) hashval[i*na+a] = col[i];
 		}
+		for (i = 0; i < m; i++)
+			hs[done+i] = gatherBits(plan, hashval+i*na);
 	}
-	bitsString(hash,buf);
-	printf("hash(%s) = %s\n", vals[0], buf);
-	return hash;
 }
 
 // compare two tuples (allowing for "unknown" values)
@@ -100,25 +189,29 @@ Bits tupleHash(Reln r, Tuple t)
 Bool tupleMatch(Reln r, Tuple t1, Tuple t2)
 {
 	Count na = nattrs(r);
-	char **v1 = malloc(na*sizeof(char *));
-	tupleVals(t1, v1);
-	char **v2 = malloc(na*sizeof(char *));
-	tupleVals(t2, v2);
-	Bool match = TRUE;
 	int i;
 	for (i = 0; i < na; i++) {
+		char *v1 = tupleAttr(t1,i), *v2 = tupleAttr(t2,i);
 		// assumes no real attribute values start with '?'
-		if (v1[i][0] == '?' || v2[i][0] == '?') continue;
-		if (strcmp(v1[i],v2[i]) == 0) continue;
-		match = FALSE;
+		if (v1[0] == '?' || v2[0] == '?') continue;
+		Count len = tupleAttrLength(t1,i);
+		if (len != tupleAttrLength(t2,i) || memcmp(v1,v2,len) != 0)
+			return FALSE;
 	}
-	freeVals(v1,na); freeVals(v2,na);
-	return match;
+	return TRUE;
 }
 
 // puts printable version of tuple in user-supplied buffer
 
 void tupleString(Tuple t, char *buf)
 {
-	strcpy(buf,t);
+	Count i, n = tupleNAttrs(t);
+	char *c = buf;
+	for (i = 0; i < n; i++) {
+		if (i > 0) *c++ = ',';
+		Count len = tupleAttrLength(t,i);
+		memcpy(c, tupleAttr(t,i), len);
+		c += len;
+	}
+	*c = '\0';
 }
@@ -1,7 +1,7 @@
 // tuple.h ... interface to functions on Tuples
 // part of Multi-attribute Linear-hashed Files
-// A Tuple is just a '\0'-terminated C string
-// Consists of "val_1,val_2,val_3,...,val_n"
+// A Tuple is a pointer to a binary-encoded tuple, made from
+//  a string of the form "val_1,val_2,val_3,...,val_n"
 // See tuple.c for details on functions
 // Last modified by John Shepherd, July 2019
 
@@ -14,8 +14,15 @@ typedef char *Tuple;
 #include "bits.h"
 
 int tupLength(Tuple t);
+Count tupleNAttrs(Tuple t);
+char *tupleAttr(Tuple t, Count i);
+Count tupleAttrLength(Tuple t, Count i);
+Tuple makeTuple(char *str);
+Tuple copyTuple(Tuple t);
 Tuple readTuple(Reln r, FILE *in);
+Tuple parseTuple(Reln r, char *line);
 Bits tupleHash(Reln r, Tuple t);
+void tupleHashBatch(Reln r, Tuple *ts, Count n, Bits *hs);
 void tupleVals(Tuple t, char **vals);
 void freeVals(char **vals, int nattrs);
 Bool tupleMatch(Reln r, Tuple t1, Tuple t2);
@@ -0,0 +1,134 @@
+// uring.c ... asynchronous reads via io_uring
+// part of Multi-attribute Linear-hashed Files
+// Uses the system calls directly, so doesn't need liburing
+
+// syscall() and mmap flags are not in plain C99
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "defs.h"
+#include "uring.h"
+
+// There is one ring per process, set up by uringInit()
+// - uringReadv() queues a read on the submission queue (SQ); the
+//   data goes into the iovecs, which must stay put until it's done
+// - uringSubmit() hands queued reads to the kernel
+// - uringReap() takes one result off the completion queue (CQ),
+//   with the tag that was given to uringReadv()
+// - at most as many reads as the SQ holds are ever outstanding,
+//   so the CQ (twice as big) can't overflow
+// If the kernel doesn't have io_uring, or won't let us use it,
+//  uringInit() fails and callers must read synchronously
+
+static int ringfd = -1;
+static unsigned *sqtail, *sqmask, *sqarray;
+static unsigned *cqhead, *cqtail, *cqmask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static Count nentries;      // size of SQ
+static Count queued = 0;    // #reads queued, not yet submitted
+static Count inflight = 0;  // #reads queued or submitted, not yet reaped
+
+static int enter(Count submit, Count wait)
+{
+	unsigned flags = (wait > 0) ? IORING_ENTER_GETEVENTS : 0;
+	return syscall(__NR_io_uring_enter, ringfd, submit, wait, flags, NULL, 0);
+}
+
+// set up a ring with room for (at least) entries reads
+
+Status uringInit(Count entries)
+{
+	struct io_uring_params p;
+	if (ringfd >= 0) return OK;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) return ~OK;
+	int prot = PROT_READ|PROT_WRITE, share = MAP_SHARED|MAP_POPULATE;
+	char *sq = mmap(NULL, p.sq_off.array + p.sq_entries*sizeof(unsigned),
+	                prot, share, fd, IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe),
+	                prot, share, fd, IORING_OFF_CQ_RING);
+	void *e = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+	               prot, share, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || e == MAP_FAILED) {
+		close(fd);
+		return ~OK;
+	}
+	sqtail = (unsigned *)(sq + p.sq_off.tail);
+	sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sqarray = (unsigned *)(sq + p.sq_off.array);
+	cqhead = (unsigned *)(cq + p.cq_off.head);
+	cqtail = (unsigned *)(cq + p.cq_off.tail);
+	cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	sqes = e;
+	nentries = p.sq_entries;
+	ringfd = fd;
+	return OK;
+}
+
+// is there no room for another read?
+
+Bool uringFull() { return (ringfd < 0 || inflight == nentries); }
+
+// queue a read from offset off of fd into n buffers, as preadv()
+// returns ~OK if the ring is full
+
+Status uringReadv(int fd, struct iovec *iov, Count n, off_t off, unsigned long tag)
+{
+	if (uringFull()) return ~OK;
+	// only we change the SQ tail
+	unsigned tail = *sqtail, i = tail & *sqmask;
+	struct io_uring_sqe *e = &sqes[i];
+	memset(e, 0, sizeof(*e));
+	e->opcode = IORING_OP_READV;
+	e->fd = fd;
+	e->addr = (unsigned long)iov;
+	e->len = n;
+	e->off = off;
+	e->user_data = tag;
+	sqarray[i] = i;
+	__atomic_store_n(sqtail, tail+1, __ATOMIC_RELEASE);
+	queued++; inflight++;
+	return OK;
+}
+
+// start all queued reads
+
+void uringSubmit()
+{
+	while (queued > 0) {
+		int n = enter(queued, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) fatal("Can't submit reads");
+		queued -= n;
+	}
+}
+
+// take the result of one finished read, giving its tag
+//  and result (#bytes read, or -errno)
+// if wait, blocks until a read finishes
+// returns FALSE if there was none to take
+
+Bool uringReap(Bool wait, unsigned long *tag, int *res)
+{
+	if (inflight == 0) return FALSE;
+	uringSubmit();
+	unsigned head = *cqhead;
+	while (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+		if (!wait) return FALSE;
+		if (enter(0, 1) < 0 && errno != EINTR)
+			fatal("Can't wait for reads");
+	}
+	struct io_uring_cqe *c = &cqes[head & *cqmask];
+	*tag = c->user_data;
+	*res = c->res;
+	__atomic_store_n(cqhead, head+1, __ATOMIC_RELEASE);
+	inflight--;
+	return TRUE;
+}
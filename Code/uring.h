@@ -0,0 +1,18 @@
+// uring.h ... interface to asynchronous reads via io_uring
+// part of Multi-attribute Linear-hashed Files
+// See uring.c for details
+
+#ifndef URING_H
+#define URING_H 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "defs.h"
+
+Status uringInit(Count);
+Bool uringFull();
+Status uringReadv(int, struct iovec *, Count, off_t, unsigned long);
+void uringSubmit();
+Bool uringReap(Bool, unsigned long *, int *);
+
+#endif
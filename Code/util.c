@@ -4,9 +4,13 @@
 //   obvious data types like File, Query, ...
 // Last modified by John Shepherd, July 2019
 
+// fileno() and fsync() are not in plain C99
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 void fatal(char *msg)
 {
@@ -20,3 +24,11 @@ char *copyString(char *str)
 	strcpy(new, str);
 	return new;
 }
+
+// make sure everything written to f is on disk
+
+void syncFile(FILE *f)
+{
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		fatal("Can't sync file to disk");
+}
@@ -9,5 +9,6 @@
 
 void fatal(char *);
 char *copyString(char *);
+void syncFile(FILE *);
 
 #endif
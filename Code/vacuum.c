@@ -0,0 +1,62 @@
+// vacuum.c ... compact the overflow chains of a Relation
+// part of Multi-attribute linear-hashed files
+// Repacks each bucket into as few pages as possible
+// Usage:  ./vacuum  [-v]  RelName
+
+#include "defs.h"
+#include "reln.h"
+
+#define USAGE "./vacuum  [-v]  RelName"
+
+// Main ... process args, compact each bucket, show savings
+
+int main(int argc, char **argv)
+{
+	char err[MAXERRMSG];  // buffer for error messages
+	int verbose;  // show per-bucket changes
+	char *relname;  // name of table/file
+
+	// process command-line args
+
+	if (argc < 2) fatal(USAGE);
+	if (strcmp(argv[1], "-v") == 0) {
+		if (argc < 3) fatal(USAGE);
+		verbose = 1; relname = argv[2];
+	}
+	else {
+		verbose = 0; relname = argv[1];
+	}
+
+	// open relation for update
+
+	if (!existsRelation(relname)) {
+		sprintf(err, "No such relation: %s", relname);
+		fatal(err);
+	}
+	Reln r = openRelation(relname,"r+");
+	if (r == NULL) fatal("Can't open relation");
+
+	// compact buckets that have overflow pages
+
+	Total before = 0, after = 0;
+	for (PageID pid = 0; pid < npages(r); pid++) {
+		Count b = bucketPages(r, pid);
+		if (b > 1 && compactBucket(r, pid) != OK) {
+			sprintf(err, "Compaction of bucket %lu failed", pid);
+			fatal(err);
+		}
+		Count a = (b > 1) ? bucketPages(r, pid) : b;
+		if (verbose && a != b)
+			printf("[%2lu]  %d -> %d pages\n", pid, b, a);
+		before += b; after += a;
+	}
+
+	printf("#buckets:%lu  #pages before:%lu  after:%lu  saved:%lu\n",
+	       npages(r), before, after, before - after);
+	printf("pages/bucket  before:%.2f  after:%.2f\n",
+	       (double)before/npages(r), (double)after/npages(r));
+
+	closeRelation(r);
+
+	return 0;
+}
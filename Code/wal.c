@@ -0,0 +1,246 @@
+// wal.c ... write-ahead log for a Relation
+// part of Multi-attribute Linear-hashed Files
+// Redo log of page images, committed in groups of operations
+
+// fileno(), ftruncate(), fsync() and flock() are not in plain C99
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/file.h>
+#include "defs.h"
+#include "wal.h"
+#include "bufpool.h"
+#include "hash.h"
+
+// R.wal is a sequence of records, each a WalRecord header
+//  followed by len bytes of image
+// - a WAL_PAGE record holds the new contents of one page
+// - a WAL_COMMIT record holds the new contents of R.info,
+//   and ends a group: all records up to it are committed
+// Pages of a logged relation are held in the buffer pool until
+//  their images are logged (see bufpool.c), so the data files
+//  only ever hold pages from committed groups, or older ones
+// The log is forced to disk once per group, not per operation;
+//  a crash loses at most the operations of the last group
+// Recovery re-applies every committed record in order, ignoring
+//  anything after the last commit (incomplete or torn records)
+// Only a writer recovers; a reader that finds committed records
+//  left by a crashed writer refuses to open the relation
+// After a checkpoint (all pages and R.info written and synced)
+//  the log is emptied
+// A writer holds an exclusive lock on R.wal while it runs, so a
+//  log that can be locked was left by a writer that has gone
+
+#define WAL_PAGE   1
+#define WAL_COMMIT 2
+
+typedef struct WalRecord {
+	Count  type;  // WAL_PAGE or WAL_COMMIT
+	Count  file;  // WAL_DATA or WAL_OVFLOW (WAL_PAGE only)
+	PageID pid;   // page number within file (WAL_PAGE only)
+	Count  len;   // #bytes of image following header
+	Bits   check; // hash of image, to spot torn records
+} WalRecord;
+
+struct WalRep {
+	FILE *log;    // handle on R.wal
+	long  size;   // #bytes in log
+	char  fname[MAXFILENAME];
+};
+
+static void walAppend(Wal w, WalRecord *rec, char *image)
+{
+	rec->check = hash_any((unsigned char *)image, rec->len);
+	int n = fwrite(rec, sizeof(WalRecord), 1, w->log);
+	n += fwrite(image, 1, rec->len, w->log);
+	if (n != 1 + rec->len) fatal("Can't write to log");
+	w->size += sizeof(WalRecord) + rec->len;
+}
+
+// read the next valid record; image must hold MAXPAGESIZE bytes
+// returns FALSE at end of log or at a damaged record
+
+static Bool walNext(FILE *log, WalRecord *rec, char *image)
+{
+	if (fread(rec, sizeof(WalRecord), 1, log) != 1) return FALSE;
+	if (rec->type != WAL_PAGE && rec->type != WAL_COMMIT) return FALSE;
+	if (rec->len > MAXPAGESIZE) return FALSE;
+	if (fread(image, 1, rec->len, log) != rec->len) return FALSE;
+	return (hash_any((unsigned char *)image, rec->len) == rec->check);
+}
+
+// open R.wal if it was left by a writer that has gone
+// returns NULL if there is no log, or its writer is still running
+//  (then the log isn't ours to redo)
+
+static FILE *walLeft(char *name)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.wal",name);
+	FILE *log = fopen(fname,"r");
+	if (log == NULL) return NULL;
+	if (flock(fileno(log), LOCK_SH|LOCK_NB) != 0) {
+		fclose(log);
+		return NULL;
+	}
+	return log;
+}
+
+// find the end of the last complete group in log
+// returns 0 if there is none
+
+static long walEnd(FILE *log, char *image)
+{
+	WalRecord rec;
+	long end = 0;
+	while (walNext(log, &rec, image))
+		if (rec.type == WAL_COMMIT) end = ftell(log);
+	return end;
+}
+
+// redo committed changes left in R.wal by a crashed writer
+// does nothing if there is no log
+// only a writer may do this: it changes the files and removes
+//  the log (see walPending() for readers)
+
+Status walRecover(char *name)
+{
+	char fname[MAXFILENAME];
+	FILE *log = walLeft(name);
+	if (log == NULL) return OK;
+	WalRecord rec;
+	char *image = malloc(MAXPAGESIZE);
+	assert(image != NULL);
+	long end = walEnd(log, image);
+
+	Status ok = OK;
+	if (end > 0) {
+		FILE *files[2], *info;
+		sprintf(fname,"%s.data",name);
+		files[WAL_DATA] = fopen(fname,"r+");
+		sprintf(fname,"%s.ovflow",name);
+		files[WAL_OVFLOW] = fopen(fname,"r+");
+		sprintf(fname,"%s.info",name);
+		info = fopen(fname,"r+");
+		if (files[WAL_DATA] == NULL || files[WAL_OVFLOW] == NULL || info == NULL)
+			ok = ~OK;
+		// re-apply everything up to there, in order
+		rewind(log);
+		while (ok == OK && ftell(log) < end && walNext(log, &rec, image)) {
+			FILE *f = (rec.type == WAL_PAGE) ? files[rec.file] : info;
+			long off = (rec.type == WAL_PAGE) ? (long)rec.pid*rec.len : 0;
+			if (fseek(f, off, SEEK_SET) != 0
+			    || fwrite(image, 1, rec.len, f) != rec.len)
+				ok = ~OK;
+		}
+		// the log is only removed once the files are safely redone
+		FILE *all[3] = { files[WAL_DATA], files[WAL_OVFLOW], info };
+		int i;
+		for (i = 0; i < 3; i++) {
+			if (all[i] == NULL) continue;
+			if (ok == OK) syncFile(all[i]);
+			fclose(all[i]);
+		}
+	}
+	free(image);
+	fclose(log);
+	if (ok == OK) {
+		sprintf(fname,"%s.wal",name);
+		unlink(fname);
+	}
+	return ok;
+}
+
+// does R.wal hold committed changes from a crashed writer?
+// until a writer redoes them, the files may not be consistent
+
+Bool walPending(char *name)
+{
+	FILE *log = walLeft(name);
+	if (log == NULL) return FALSE;
+	char *image = malloc(MAXPAGESIZE);
+	assert(image != NULL);
+	long end = walEnd(log, image);
+	free(image);
+	fclose(log);
+	return (end > 0);
+}
+
+// is a writer running on relation name?
+
+Bool walBusy(char *name)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.wal",name);
+	FILE *log = fopen(fname,"r");
+	if (log == NULL) return FALSE;
+	Bool busy = (flock(fileno(log), LOCK_SH|LOCK_NB) != 0);
+	fclose(log);
+	return busy;
+}
+
+// start a new, empty log for relation name
+// only one writer may run at a time
+
+Wal walOpen(char *name)
+{
+	Wal w = malloc(sizeof(struct WalRep));
+	assert(w != NULL);
+	sprintf(w->fname,"%s.wal",name);
+	// lock before emptying, so a running writer's log is left alone
+	w->log = fopen(w->fname,"a");
+	if (w->log == NULL) fatal("Can't create log");
+	if (flock(fileno(w->log), LOCK_EX|LOCK_NB) != 0)
+		fatal("Relation is being updated by another process");
+	if (ftruncate(fileno(w->log), 0) != 0) fatal("Can't truncate log");
+	w->size = 0;
+	return w;
+}
+
+// log images of all unlogged buffered pages of file f
+
+typedef struct { Wal w; Count file; } LogTarget;
+
+static void logPage(void *arg, PageID pid, void *page, Count size)
+{
+	LogTarget *t = arg;
+	WalRecord rec = { WAL_PAGE, t->file, pid, size, 0 };
+	walAppend(t->w, &rec, page);
+}
+
+void walLogFile(Wal w, FILE *f, Count file)
+{
+	LogTarget t = { w, file };
+	bufLogPages(f, logPage, &t);
+}
+
+// end a group with the current R.info contents
+// and force the log to disk
+
+void walCommit(Wal w, char *info, Count len)
+{
+	WalRecord rec = { WAL_COMMIT, 0, NO_PAGE, len, 0 };
+	walAppend(w, &rec, info);
+	syncFile(w->log);
+}
+
+long walSize(Wal w) { return w->size; }
+
+// empty the log, after a checkpoint
+
+void walReset(Wal w)
+{
+	fflush(w->log);
+	if (ftruncate(fileno(w->log), 0) != 0) fatal("Can't truncate log");
+	rewind(w->log);
+	w->size = 0;
+}
+
+// finished with log; caller has checkpointed, so remove it
+
+void walClose(Wal w)
+{
+	fclose(w->log);
+	unlink(w->fname);
+	free(w);
+}
@@ -0,0 +1,28 @@
+// wal.h ... interface to the write-ahead log
+// part of Multi-attribute Linear-hashed Files
+// See wal.c for details of log records and recovery
+
+#ifndef WAL_H
+#define WAL_H 1
+
+typedef struct WalRep *Wal;
+
+#include "defs.h"
+
+#define WALGROUP    128        // operations per group commit
+#define WALMAXSIZE  (16 << 20) // checkpoint when log is bigger than this
+
+#define WAL_DATA    0          // page image is from R.data
+#define WAL_OVFLOW  1          // page image is from R.ovflow
+
+Status walRecover(char *name);
+Bool walPending(char *name);
+Bool walBusy(char *name);
+Wal walOpen(char *name);
+void walLogFile(Wal w, FILE *f, Count file);
+void walCommit(Wal w, char *info, Count len);
+long walSize(Wal w);
+void walReset(Wal w);
+void walClose(Wal w);
+
+#endif